@@ -9,28 +9,214 @@
 	Contact:	jeff <at> mightyohm.com
 
 	This firmware controls the ATtiny2313 AVR microcontroller on board the Geiger Counter kit.
+	The ATtiny2313 has 128 bytes of SRAM and 2K of flash, the default options just fit: the sample buffer alone
+	takes 60 bytes, so a few flags and counters live in the general purpose I/O registers, and the settings are
+	constants.  The transmit buffer, COMMANDS, MODBUS and the options that keep more state need the pin compatible
+	ATtiny4313 (256 bytes of SRAM, 4K of flash), build them with "make DEVICE=attiny4313".  The Makefile checks
+	that the globals leave at least STACK bytes of SRAM for the stack, and that the program fits in the flash.
 
 	When an impulse from the GM tube is detected, the firmware flashes the LED and produces a short
-	beep on the piezo speaker.  It also outputs an active-high pulse (default 100us) on the PULSE pin.
+	beep on the piezo speaker.  The flash and beep are timed by Timer0, which stops itself after FLASH_LEN
+	milliseconds, so the main loop never waits for them.  Events during a flash extend it.
+	It also outputs an active-high pulse (default 100us) on the PULSE pin.  The pulse is ended by a
+	Timer1 compare match, so the GM interrupt itself only takes a few microseconds.
 
-	A pushbutton on the PCB can be used to mute the beep.
+	A pushbutton on the PCB can be used to mute the beep.  The button is sampled every Timer1 tick
+	(TICKS_PER_SEC times a second) and must read the same for 4 ticks in a row, so switch bounce is
+	filtered without blocking any interrupts.
+
+	If COUNT_HW is set to 1, GM pulses are counted in hardware instead: the tube signal must also be wired to
+	the T0 input (PD4), which clocks Timer0, and the once a second Timer1 interrupt just reads and clears it.
+	No CPU time is spent per event, so the count rate is only limited by the tube.  Timer0 is no longer
+	available for the piezo, so in this mode there is no beep and no PULSE output, and the LED flashes once
+	a second when counts were seen.
 
 	A running average of the detected counts per second (CPS), counts per minute (CPM), and equivalent dose
-	(uSv/hr) is output on the serial port once per second. The dose is based on information collected from
+	(uSv/hr) is output on the serial port once per second.  The Timer1 interrupt only hands the count of the last
+	second to the main loop (with a sequence number, so neither side has to disable interrupts), which does the
+	averaging in update() and collects everything sendreport() needs in one report struct.  If the main loop falls behind and a second is
+	lost, the report ends with ", MISSED, ###". The dose is based on information collected from
 	the web, and may not be accurate.
 
-	The serial port is configured for BAUD baud, 8-N-1 (default 9600).
+	CPM is converted to uSv/hr with a calibration curve for the GM tube, chosen from caltab with the G command
+	(default TUBE, the SBM-20).  Each curve has up to CAL_POINTS piecewise linear segments: from its start CPM
+	on, every CPM adds factor/100,000 uSv/hr.  The curves in caltab are the single factors commonly published
+	for each tube, a tube whose sensitivity changes with the rate can get more segments, with increasing start
+	CPM ("make test" checks the table).  The curve is applied to the reported CPM (after any dead time
+	correction), and is evaluated in 32 bit integer math (uSv/hr x100,000), saturating at 42949 uSv/hr.  The
+	uSv/hr uncertainty is the difference the CPM uncertainty makes on the curve.
+
+	The serial port is configured for BAUD baud, 8-N-1 (default 9600).  The divisor is computed at build time,
+	using the UART's double speed mode (U2X) if that gets closer to the requested rate, and the build fails if
+	the rate is off by more than BAUD_TOL percent.  With COMMANDS, uart_setbaud() switches to any rate in BAUD_TABLE,
+	these are all within 0.2% at 8 MHz (2400 to 76800, 250000, 500000 and 1000000 baud).
+	By default each character is written to the UART as soon as it is ready for it, so a report line keeps the
+	main loop busy for about 60 ms at 9600 baud (the interrupts still run, so no counts are lost).  With
+	TX_BUFF_LEN set, output is queued in a TX_BUFF_LEN byte ring buffer and sent by the UART data register empty
+	interrupt, so reporting doesn't keep the CPU busy.  If the buffer fills up, characters are dropped and the next
+	report ends with ", TXOVF, ###" (the number of characters lost).  The buffer is smaller than a report, so
+	sendline() sends the report a field at a time as the buffer empties, and update() leaves the report alone
+	until the line is done.  Nothing else is sent until then: commands wait (so their answers, a D dump or an
+	F switch to binary can't land inside the line), and a report doesn't start during a dump.
 
 	The data is reported in comma separated value (CSV) format:
-	CPS, #####, CPM, #####, uSv/hr, ###.##, SLOW|FAST|INST
+	CPS, #####, CPM, #####, uSv/hr, ###.##, SLOW|FAST|INST|COUNT, +-, #####, ###.##, TOTAL, #####, DOSE, #.###[, WARMUP]
+
+	If UNC_K is set, "+-" is followed by the counting uncertainty of the CPM and uSv/hr values, UNC_K/10 standard
+	deviations (10 = 1 sigma).  They are based on the number of counts the reported CPM comes from, so they depend
+	on the mode and window length: a window with n counts is uncertain by 1/sqrt(n) of its value.  The dead time
+	correction multiplies the rate by 1/(1 - rate*DEADTIME), and its relative uncertainty as well, so at
+	high rates the uncertainty grows faster than the CPM.  The uncertainty costs 4 bytes of SRAM and about a
+	kilobyte of flash, so it is off (UNC_K = 0) by default.
+
+	If DOSE is set to 1, the counter also integrates the dose: TOTAL is the number of counts and DOSE the dose in uSv
+	(with 3 decimals), both corrected for dead time like the report, since the Z command (or the first power up).
+	The dose is kept in nSv and both saturate at 2^32-1, that is more than 4 Sv, or over 200 years at 100 CPM.  They are
+	saved in EEPROM every DOSE_SAVE minutes (so a power cut loses at most that much) and reloaded at power up.
+	The two most recent saves are kept, each with a CRC, so a power cut while saving can't lose the total.
+	The dose costs 15 bytes of SRAM, so it is off by default.
+
+	WARMUP means there is less than LONG_PERIOD seconds of data since power up (or the R command).  It comes last
+	on the line (after MISSED and TXOVF), so it doesn't move the other fields.  The averages only use the seconds
+	there are, so the first report after power up is already a (rough) measurement.
+
+	If BINARY_REPORT is set to 1, a 15 byte binary frame is sent instead of the CSV line, which is quicker to send
+	and doesn't need any text parsing.  The frame is COBS encoded (so it contains no zero bytes) and ends with a
+	0x00 delimiter.  Decoded, it is 13 bytes, little endian, with every field at a multiple of its size, so it
+	can be copied into a struct as is, see struct frame:
+	CRC-16/MODBUS of the rest of the frame (2 bytes), seq (1, counts seconds), mode (1, 0 = SLOW, 1 = FAST,
+	2 = INST, 3 = COUNT, +0x80 = WARMUP), CPM (4), CPS (2), uSv/hr x100 (2, saturates at 655.35),
+	CPM uncertainty (1, in the 8-bit format of the sample buffer, see unpacksample(), saturates at 4032, 0
+	without UNC_K).
+	With DOSE, a 12 byte dose frame follows the report once a minute (and after ?), see struct doseframe:
+	CRC (2), seq (1), kind (1, always 0x40, which no mode byte has), TOTAL (4), DOSE in nSv (4).
+
+	If COMMANDS is set to 1, the counter also accepts commands on the serial port.  A command is a letter, optionally
+	followed by a number, and ends with CR or LF.  Commands are answered with "OK" or "ERR", except for ? and D.
+	?	send a report now
+	I n	report every n seconds (default 1), 0 = only when asked with ?
+	T n	switch to FAST mode on a change of more than n/10 standard deviations (default CHANGE_Z)
+	S n	check the last n seconds for a change (default SHORT_PERIOD), n must divide LONG_PERIOD
+	M [n]	toggle mute, or mute (n = 1) or unmute (n = 0) the beeper
+	D	dump the sample buffer, CPS of the last LONG_PERIOD seconds, oldest first
+	R	reset all counters and averages (but not the dose)
+	B n	change the baud rate to n (one of the rates in BAUD_TABLE), the answer is sent at the old rate
+	F n	send CSV (n = 0) or binary (n = 1) reports
+	N n	fixed count mode with n counts per report (1 to 32767), 0 = off (only with FIXED_COUNT)
+	A n	set the bus address to n (1 to ADDR_MAX), 0 = point to point (saved in EEPROM)
+	Z	reset the dose and the total count (only with DOSE)
+	G n	use the calibration curve of GM tube n (see caltab) for uSv/hr and the dose (saved in EEPROM)
+	C [n]	clock calibration: send C, wait (an hour or more), then send C n, where n is the number of seconds
+		the host measured between the two lines.  The measured error is added to the clock trim.
+	P [n]	set the clock trim to n ppm (-TRIM_MAX to TRIM_MAX), or show it (saved in EEPROM)
+
+	The timebase is the crystal, which is typically off by 10 to 100 ppm.  With TRIM, it is corrected by a trim
+	value in ppm (positive if the crystal is fast): ISR(TIMER1_COMPA_vect) adds it up every period, and when a
+	whole Timer1 tick (32us) has accumulated, makes the next period a tick longer or shorter.  So every second is
+	within 32us, and on average the seconds are as exact as the trim, to about 1 ppm.  The trim can be set with
+	P, or measured with C against the host's clock.  There is no pin left for a reference pulse train (the input
+	capture pin is the PULSE output), so the serial line is the reference: ISR(USART_RX_vect) notes the Timer1
+	time at the end of each command line, which is a fixed 9.5 bit times after the start bit edge of its last
+	character, and C compares the time between two lines with the time the host measured between sending them.
+	A host synchronized with NTP sends to within a few ms (a USB serial adapter adds up to 1ms), so an hour
+	gives about 1 ppm.  Don't change the baud rate in between, that changes the fixed delay.
+	Event timestamps (TIMESTAMPS) are in uncorrected Timer1 ticks.  TRIM costs 4 bytes of SRAM, 12 with
+	COMMANDS for the C command, so it is off by default and needs the ATtiny4313.
+
+	If MULTIDROP is set to 1, many counters can share one serial bus (RS-485, with the transceiver's driver enable on
+	DE_PIN, which is only high while the counter transmits).  A counter with an address stays silent: it sends
+	no banner, no periodic reports (unless I is used), and ignores every line that doesn't start with
+	"@address", for example "@12?" for the latest report of counter 12 or "@12 I 0".  "@0" is a broadcast,
+	all counters carry out the command but none of them answers (so ?, D and P without a number are ignored).
+	Without an address (the default, and what an erased EEPROM gives) the counter behaves as before, and also
+	accepts "@0".  MULTIDROP is off by default because it drives DE_PIN as an output on every counter, which
+	only makes sense with a transceiver there.
 
 	There are three modes.  Normally, the sample period is LONG_PERIOD (default 60 seconds). This is SLOW averaging mode.
-	If the last five measured counts exceed a preset threshold, the sample period switches to SHORT_PERIOD seconds (default 5 seconds).
-	This is FAST mode, and is more responsive but less accurate. Finally, if CPS > 255, we report CPS*60 and switch to
-	INST mode, since we can't store data in the (8-bit) sample buffer.  This behavior could be customized to suit a particular
-	logging application.
-
-	The largest CPS value that can be displayed is 65535, but the largest value that can be stored in the sample buffer is 255.
+	Every second, the counts of the last SHORT_PERIOD seconds (default 5 seconds) are compared with what the
+	longer average predicts.  If they differ by more than CHANGE_Z/10 standard deviations (Poisson statistics),
+	the count rate has really changed, and the older samples are no longer used: the average restarts from the
+	last SHORT_PERIOD seconds and then grows by a second every second.  This is FAST mode, and is more responsive
+	but less accurate.  When the average is LONG_PERIOD seconds long again, we're back in SLOW mode.  So a step
+	shows up within a few seconds at any count rate, while noise doesn't make the mode flap (with the default
+	of 5 standard deviations, a false switch happens less than once an hour at background levels).
+	Finally, if CPS > SAMPLE_MAX (4063), we report CPS*60 and switch to INST mode, since we can't store data in the
+	(8-bit) sample buffer.  This behavior could be customized to suit a particular logging application.
+
+	If FIXED_COUNT is set to 1, there is a fourth mode, COUNT (started with FC_COUNT counts per report, or the N
+	command).  Instead of a fixed time, each measurement lasts until n counts were seen, or FC_MAXTIME seconds.
+	The relative uncertainty is then always about 1/sqrt(n) (before the dead time correction), and at high
+	rates reports come faster than once a second.  ISR(TIMER1_COMPA_vect) checks the count every tick, so a
+	measurement is timed to 8ms.
+	The report gives the average CPS and CPM over the measurement, and is sent when it ends (not every I
+	seconds, and never unasked when I is 0).  seq counts measurements instead of seconds.  The averages for
+	the other modes are kept up to date in the meantime.  The measurement costs 10 bytes of SRAM (11 with a
+	sequence number), so FIXED_COUNT is off by default and needs the ATtiny4313.
+
+	To fit 60 samples in the little SRAM there is, each sample is stored in one byte as a tiny floating point
+	number: 3 bits of exponent and 5 bits of mantissa.  Values up to 63 are exact, larger values are rounded to the
+	nearest representable value (at most 1/64 = 1.6% off, well below the counting statistics at that rate).
+
+	If TIMESTAMPS is set to 1, the CSV report is replaced by a binary stream with the arrival time of every
+	event, for burst and coincidence analysis.  ISR(INT0_vect) reads Timer1 (32us resolution) into a small
+	ring buffer, and the main loop sends the time since the previous event as an unsigned LEB128 varint
+	(7 bits per byte, least significant first, high bit set on all but the last byte), in units of 32us.
+	Once a second, a marker 0x80 0x00 is sent, followed by the number of events dropped since the last
+	marker (also a varint).  The encoder never produces 0x80 0x00, so a host can sync on it.  Events are
+	dropped when the ring buffer is full because the serial port can't keep up, so use a high baud rate.
+	Nothing else is sent in this mode, so the stream stays parseable: there are no reports (not even for ? or
+	a fixed count measurement), commands are carried out without an answer, and D is ignored.
+	(The Timer1 input capture pin is PD6, which is the PULSE output on this board, so it can't be used.)
+
+	At high count rates the GM tube misses events that arrive while it is still recovering from the last one.
+	With DEADTIME set, the reported CPS and CPM (and so uSv/hr) are corrected for this with the non-paralyzable
+	dead time model, n = m / (1 - m*DEADTIME), where m is the measured and n the true rate.  DEADTIME is the tube
+	dead time, or the time ISR(INT0_vect) needs per event (ISR_DEADTIME) if that is longer.  The correction is
+	limited to 16x (15/16 of the time dead), beyond that the tube is saturated and no count rate can be trusted.
+	The correction is off by default (DEADTIME 0, the raw counts are reported), because its 32-bit math doesn't
+	fit in the flash of the ATtiny2313 with the rest.  It hardly matters at background levels (0.01% at 30 CPM for
+	the SBM-20), but at 1000 CPS the SBM-20 misses 19%: set DEADTIME to 190 and build for the ATtiny4313.
+
+	If CASCADE is set to 1, longer averages are kept as well: every minute the CPM of the last minute is
+	pushed into a ring of CASCADE_MIN minutes, and every CASCADE_MIN minutes their average is pushed into a
+	ring of CASCADE_HOUR entries.  With the defaults this gives a 10 minute and a 1 hour average, which are
+	added to the report as ", CPM10M, #####, CPM1H, #####".  The hourly average moves in 10 minute steps.
+	Until the windows have filled up, after power up or a reset, they average the minutes seen so far
+	(the 1 hour average the complete 10 minute steps), and in the first minute both show the CPM.
+	These windows store CPM in 16 bits, so they saturate at 65535 CPM, and their averages are added up from
+	the entries when needed.  This costs 36 bytes of SRAM, so it is off by default and needs the ATtiny4313.
+
+	If MODBUS is set to 1 (instead of COMMANDS), the counter is a Modbus RTU slave, at the address set by MULTIDROP
+	(address 1 if none was set).  Function codes 03 and 06 read and write holding registers, 04 reads input
+	registers.  32-bit values take two registers, high word first.  Broadcasts (address 0) are only accepted
+	for 06.  A frame ends after 3.5 characters of silence (MB_T35), which is measured with Timer1, and is
+	answered at the next main loop pass, within about 8ms.
+	Input registers (04):
+	0	CPS, as reported
+	1, 2	CPM, as reported
+	3, 4	slow average CPM
+	5, 6	fast average CPM
+	7	mode, 0 = SLOW, 1 = FAST, 2 = INST, 3 = COUNT
+	8	uSv/hr x100 (saturates at 655.35)
+	9	report sequence number, counts seconds
+	10	seconds of data in the averages, WARMUP while less than LONG_PERIOD
+	11, 12	CPM uncertainty (only with UNC_K)
+	13	uSv/hr uncertainty x100 (only with UNC_K)
+	14, 15	total counts (only with DOSE)
+	16, 17	dose in nSv (only with DOSE)
+	Holding registers (03, 06):
+	0	bus address, 1 to ADDR_MAX (saved in EEPROM)
+	1	FAST mode change threshold, in tenths of a standard deviation
+	2	change detection window in seconds, must divide LONG_PERIOD
+	3	mute, 0 or 1
+	4	write 1 to reset all counters and averages, reads 0
+	5	fixed count target, 0 = off (only with FIXED_COUNT)
+	6	write 1 to reset the dose and the total count, reads 0 (only with DOSE)
+	7	clock trim in ppm, signed (only with TRIM)
+	8	GM tube type, index of caltab (saved in EEPROM)
+
+	The largest CPS value that can be displayed is 65535, but the largest value that can be stored in the sample buffer
+	is 4063 (stored as 4032).
 
 	***** WARNING *****
 	This Geiger Counter kit is for EDUCATIONAL PURPOSES ONLY.  Don't even think about using it to monitor radiation in
@@ -63,8 +249,9 @@
 #include <avr/interrupt.h>		// interrupt service routines
 #include <avr/pgmspace.h>		// tools used to store variables in program memory
 #include <avr/sleep.h>			// sleep mode utilities
-#include <util/delay.h>			// some convenient delay functions
-#include <stdlib.h>			// some handy functions like utoa()
+#include <util/atomic.h>		// ATOMIC_BLOCK for reading variables shared with an ISR
+#include <util/crc16.h>			// CRC used in the binary report
+#include <avr/eeprom.h>			// settings that survive a power cycle
 
 // Defines
 #define VERSION		"1.00"
@@ -72,126 +259,1181 @@
 
 #define	F_CPU		8000000		// AVR clock speed in Hz
 #define	BAUD		9600		// Serial BAUD rate
-#define SER_BUFF_LEN	11		// Serial buffer length
-#define THRESHOLD	1000		// CPM threshold for fast avg mode
+#define BAUD_TOL	2		// max. baud rate error in percent
+#define RX_BUFF_LEN	16		// Serial command buffer length
+#define COMMANDS	0		// 1 = accept commands on the serial port
+#define MULTIDROP	0		// 1 = bus address and poll mode, see the A command
+#define ADDR_MAX	247		// highest bus address
+#define DE_PIN		PD5		// RS-485 driver enable output (port D)
+#define MODBUS		0		// 1 = Modbus RTU slave instead of COMMANDS, see checkmodbus()
+#define MB_BUFF_LEN	6		// Modbus receive buffer length, longer frames are only checked
+#define TX_BUFF_LEN	0		// UART transmit buffer length (power of 2), 0 = wait for the UART instead
+#define TX_FIELD	20		// longest piece of a report line, see sendline()
+#define CHANGE_Z	50		// switch to fast avg mode on a change of more than 5.0 standard deviations
 #define LONG_PERIOD	60		// # of samples to keep in memory in slow avg mode
 #define SHORT_PERIOD	5		// # or samples for fast avg mode
-#define SCALE_FACTOR	57		// CPM to uSv/hr conversion factor (x10,000 to avoid float)
+#define TUBE		0		// GM tube type at first power up (index of caltab)
+#define CAL_POINTS	4		// max. # of segments of a calibration curve
+#define UNC_K		0		// report the uncertainty as UNC_K/10 standard deviations (10 = 1 sigma), 0 = off
+#define DOSE		0		// 1 = integrate the dose and keep it in EEPROM, see adddose()
+#define DOSE_SAVE	60		// save the dose in EEPROM every DOSE_SAVE minutes
+#define DEADTIME	0		// GM tube dead time in microseconds (190 for the SBM-20), 0 = no dead time correction
+#define TIMESTAMPS	0		// 1 = stream event timestamps instead of the CSV report
+#define BINARY_REPORT	0		// 1 = send a binary frame instead of the CSV report, see sendframe()
+#define TS_BUFF_LEN	8		// timestamp buffer length (power of 2)
 #define PULSEWIDTH	100		// width of the PULSE output (in microseconds)
+#define SAMPLE_MAX	4063		// largest CPS that fits in the sample buffer, see packsample()
+#define CASCADE		0		// 1 = also keep 10 minute and 1 hour averages
+#define CASCADE_MIN	10		// # of 1 minute samples in the first cascade window
+#define CASCADE_HOUR	6		// # of CASCADE_MIN samples in the second cascade window
+#define COUNT_HW	0		// 1 = count GM pulses with Timer0 on the T0 pin instead of INT0
+#define FIXED_COUNT	0		// 1 = fixed count measurement mode, see fixedcount()
+#define FC_COUNT	400		// counts per fixed count measurement at power up (5% uncertainty), 0 = off
+#define FC_MAXTIME	60		// max. length of a fixed count measurement in seconds
+#define FLASH_LEN	10		// length of the LED flash and piezo click (in milliseconds)
+#define TONE_TOP	160		// Timer0 compare value, toggle the piezo every 161us (3.1kHz)
+#define TICKS_PER_SEC	125		// Timer1 interrupts per second, the button is sampled at this rate
+#define TRIM		0		// 1 = correct the crystal error, see settrim()
+#define TRIM_MAX	2000		// largest clock trim in ppm
+
+// Derived values and sanity checks
+#define FLASH_TICKS	((FLASH_LEN*1000UL)/(TONE_TOP+1))	// FLASH_LEN in Timer0 compare matches
+#define DOSE_DIV	360000UL	// uSv/hr x100,000 for a second per nSv (100,000 x 3600 seconds / 1000)
+#if DOSE_SAVE < 1 || DOSE_SAVE*60UL > UINT16_MAX
+#error "DOSE_SAVE must be 1 to 1092 minutes"
+#endif
+
+#if UNC_K < 0 || UNC_K > 30
+#error "UNC_K must be 0 to 30"
+#endif
+
+#if FLASH_TICKS > UINT8_MAX
+#error "FLASH_LEN is too long"
+#endif
+
+#define T1_TICK_US	(256000000UL/F_CPU)	// length of a Timer1 tick in microseconds (prescaler = 256)
+#define T1_TOP		(F_CPU/256/TICKS_PER_SEC - 1)	// OCR1A value, Timer1 counts 0..T1_TOP
+#if (F_CPU/256) % TICKS_PER_SEC || T1_TOP > UINT16_MAX
+#error "TICKS_PER_SEC must divide F_CPU/256"
+#endif
+
+#if SHORT_PERIOD >= LONG_PERIOD || LONG_PERIOD % SHORT_PERIOD
+#error "SHORT_PERIOD must be a divisor of LONG_PERIOD"
+#endif
+#if !(COMMANDS || MODBUS) && SHORT_PERIOD*SAMPLE_MAX > 65535
+#error "fastsum is 16 bits without COMMANDS or MODBUS, SHORT_PERIOD is too long for that"
+#endif
+
+#if COUNT_HW
+#define ISR_DEADTIME	0		// events are counted in hardware
+#else
+#define ISR_DEADTIME	5		// time ISR(INT0_vect) keeps interrupts off per event (in microseconds)
+#endif
+#define SYS_DEADTIME	(DEADTIME > ISR_DEADTIME ? DEADTIME : ISR_DEADTIME)	// dead time of the whole counter
+
+// Dead time per unit of rate, as a fraction of 2^32, and the rate at which 15/16 of the time is dead
+#define DT_CPS		((SYS_DEADTIME * 4294967296ULL + 500000) / 1000000)
+#define DT_CPM		((SYS_DEADTIME * 4294967296ULL + 30000000) / 60000000)
+#define DT_CPS_MAX	(4026531840UL / DT_CPS)
+#define DT_CPM_MAX	(4026531840UL / DT_CPM)
+
+#define PULSE_TICKS	(PULSEWIDTH/T1_TICK_US + 1)	// PULSE width in Timer1 ticks (100us = 96-128us)
+#define T1_HZ		(F_CPU/256)	// Timer1 ticks per second
+#define TRIM_TICK	(1000000/(T1_TOP+1))	// ppm of a period that make a whole Timer1 tick
+#if TRIM && (1000000 % T1_HZ || TRIM_MAX*(T1_TOP+1UL) >= 1000000)
+#error "TRIM needs a whole number of ppm per Timer1 tick, and at most one tick of correction per period"
+#endif
+
+#if PULSE_TICKS > T1_TOP
+#error "PULSEWIDTH is longer than a Timer1 tick"
+#endif
+
+#if CASCADE && LONG_PERIOD != 60
+#error "CASCADE is fed from the slow window, which must be one minute long"
+#endif
+
+#if FC_MAXTIME*TICKS_PER_SEC > UINT16_MAX || FC_COUNT > 32767
+#error "FC_MAXTIME or FC_COUNT is too big"
+#endif
+
+#if TIMESTAMPS && COUNT_HW
+#error "TIMESTAMPS needs ISR(INT0_vect), it doesn't work with COUNT_HW"
+#endif
+#if TIMESTAMPS && MODBUS
+#error "TIMESTAMPS uses the serial port for the timestamp stream, Modbus answers would break it"
+#endif
+#if TS_BUFF_LEN & (TS_BUFF_LEN-1)
+#error "TS_BUFF_LEN must be a power of 2"
+#endif
+
+#if MULTIDROP && !(COMMANDS || MODBUS)
+#error "MULTIDROP needs COMMANDS or MODBUS"
+#endif
+#if (COMMANDS || MODBUS) && !TX_BUFF_LEN
+#error "COMMANDS and MODBUS need the transmit buffer (TX_BUFF_LEN), and so the ATtiny4313"
+#endif
+#if MODBUS && COMMANDS
+#error "MODBUS and COMMANDS both use the UART receiver, only enable one"
+#endif
+#if MODBUS && !MULTIDROP
+#error "MODBUS needs MULTIDROP for the bus address and driver enable"
+#endif
+
+// Modbus frame gap: 3.5 characters of 11 bits, or 1750us above 19200 baud, in Timer1 ticks
+#define MB_T35		((BAUD > 19200 ? 1750 : 38500000UL/BAUD) / T1_TICK_US + 1)
+#define MB_INPUTS	(14 + 4*DOSE)	// # of input registers
+#define MB_HOLDING	9		// # of holding registers
+
+#if TX_BUFF_LEN & (TX_BUFF_LEN-1)
+#error "TX_BUFF_LEN must be a power of 2"
+#endif
+#if TX_BUFF_LEN && TX_BUFF_LEN <= TX_FIELD
+#error "TX_BUFF_LEN is too small for a piece of the report"
+#endif
+
+// UART divisor for baud rate b, d = 16UL in normal mode or 8UL with U2X, and the resulting error in 1/1000
+// d must be unsigned long: int is 16 bits on the AVR, and d*b doesn't fit in it for most rates.
+#define UBRR_VAL(b, d)	((F_CPU + (d)/2*(b)) / ((d)*(b)) - 1)
+#define BAUD_REAL(b, d)	(F_CPU / ((d)*(UBRR_VAL(b, d) + 1)))
+#define BAUD_ERR(b, d)	((BAUD_REAL(b, d) > (b) ? BAUD_REAL(b, d) - (b) : (b) - BAUD_REAL(b, d)) * 1000 / (b))
+// Use U2X only if it is more accurate, normal mode samples each bit more often
+#define BAUD_U2X(b)	(BAUD_ERR(b, 8UL) < BAUD_ERR(b, 16UL))
+#define BAUD_UBRR(b)	(BAUD_U2X(b) ? UBRR_VAL(b, 8UL) : UBRR_VAL(b, 16UL))
+#define BAUD_OK(b)	((BAUD_U2X(b) ? BAUD_ERR(b, 8UL) : BAUD_ERR(b, 16UL)) <= BAUD_TOL*10 && BAUD_UBRR(b) < 4096)
+
+#if !BAUD_OK(BAUD)
+#error "BAUD can't be generated accurately from F_CPU"
+#endif
+
+// Baud rates for uart_setbaud(), X(rate) for each
+#define BAUD_TABLE(X)	X(2400) X(4800) X(9600) X(19200) X(38400) X(76800) X(250000) X(500000) X(1000000)
+#define BAUD_CHECK(b)	_Static_assert(BAUD_OK(b), "baud rate " #b " can't be generated accurately from F_CPU");
+BAUD_TABLE(BAUD_CHECK)
+
+// Data types
+struct report {				// everything sendreport() needs, built once a second by update()
+#if BINARY_REPORT || COMMANDS || MODBUS
+	uint8_t seq;			// tickseq of the second this report is for (the CSV report doesn't need it)
+#endif
+	uint8_t mode;			// logging mode, 0 = slow, 1 = fast, 2 = inst
+	uint16_t cps;			// GM counts in the last second
+	uint32_t cpm;			// CPM value we will report
+#if UNC_K
+	uint32_t unc;			// counting uncertainty of cpm, see uncertainty()
+#endif
+};
+
+struct dosesave {			// dose checkpoint in EEPROM, see savedose()
+	uint32_t total;			// total counts
+	uint32_t dose;			// dose in nSv
+	uint16_t crc;			// CRC-16/MODBUS of the bytes above
+};
+
+struct calpoint {			// segment of a calibration curve, see usv()
+	uint32_t cpm;			// CPM where the segment starts, 0 = unused (except in the first one)
+	uint16_t factor;		// uSv/hr x100,000 per CPM
+};
+
+struct baud {				// entry of baudtab
+	uint32_t rate;			// baud rate
+	uint16_t ubrr;			// UBRR value, bit 15 set if U2X is needed
+};
+
+struct frame {				// binary report, see sendframe()
+	uint16_t crc;			// CRC-16/MODBUS of the bytes below
+	uint8_t seq;			// report.seq
+	uint8_t mode;			// report.mode, bit 7 set while warming up
+	uint32_t cpm;			// report.cpm
+	uint16_t cps;			// report.cps
+	uint16_t usv;			// uSv/hr x100
+	uint8_t unc;			// report.unc, saturating, see packsample()
+};
+#if TX_BUFF_LEN
+_Static_assert(sizeof(struct frame) + 2 < TX_BUFF_LEN, "a COBS encoded frame must fit in txbuf");
+#endif
+
+#if DOSE
+#define DOSE_FRAME	0x40		// kind of a struct doseframe, in place of the mode of a struct frame
+
+struct doseframe {			// binary dose report, see senddose()
+	uint16_t crc;			// CRC-16/MODBUS of the bytes below
+	uint8_t seq;			// report.seq
+	uint8_t kind;			// DOSE_FRAME
+	uint32_t total;			// total counts
+	uint32_t dose;			// dose in nSv
+};
+_Static_assert(sizeof(struct doseframe) <= sizeof(struct frame), "sendreport() waits for room for a struct frame");
+#endif
 
 // Function prototypes
+void uart_putbyte(uint8_t b);		// send a byte to the serial port, without any translation
 void uart_putchar(char c);		// send a character to the serial port
-void uart_putstring(char *buffer);	// send a null-terminated string in SRAM to the serial port
 void uart_putstring_P(char *buffer);	// send a null-terminated string in PROGMEM to the serial port
-
+void uart_putdec(uint32_t v);		// send a number in decimal
+void uart_flush(void);			// wait until the transmit buffer is empty
+#if COMMANDS
+uint8_t uart_setbaud(uint32_t rate);	// change the baud rate, returns 0 if rate is not in baudtab
+uint16_t findbaud(uint32_t rate);	// look up a baud rate in baudtab
+#endif
+uint8_t uart_txfree(void);		// number of bytes that fit in the transmit buffer
+#if TIMESTAMPS
+void uart_putvarint(uint32_t v);	// send a number in LEB128 format
+
+void sendstamps(void);			// send the event timestamps collected by ISR(INT0_vect)
+#endif
+#if TIMESTAMPS || MODBUS
+uint16_t timestamp(void);		// current time in Timer1 ticks (call with interrupts disabled)
+#endif
+
+uint8_t packsample(uint16_t n);		// convert a CPS value to its 8-bit sample buffer format
+uint16_t unpacksample(uint8_t s);	// convert an 8-bit sample back to CPS
+uint32_t bufsum(uint8_t n);		// sum of the newest n samples
+#if CASCADE
+void cascade(uint32_t cpm);		// feed one minute into the long averaging windows
+uint16_t cascavg(uint16_t *buf, uint8_t len, uint8_t n);	// average of a cascade window
+#endif
+
+uint8_t update(void);			// update the averages once a second
+#if DEADTIME
+uint32_t deadtime(uint32_t rate, uint32_t dt, uint32_t max);	// correct a count rate for dead time
+#endif
+uint16_t isqrt(uint32_t v);		// integer square root
+#if UNC_K
+uint32_t uncertainty(uint32_t cpm, uint32_t raw, uint32_t n, uint16_t t);	// counting uncertainty of a CPM value
+#endif
 void checkevent(void);			// flash LED and beep the piezo
-void sendreport(void);			// log data over the serial port
+#if FIXED_COUNT
+void fixedcount(void);			// build the report when a fixed count measurement has ended
+void setfixed(uint16_t n);		// start fixed count measurements of n counts, 0 = off
+#endif
+#if COMMANDS
+void checkcommand(void);		// handle a command received on the serial port
+void senddump(void);			// send the sample buffer, a bit at a time
+#endif
+#if MODBUS
+void checkmodbus(void);			// answer a Modbus request
+uint16_t mbread(uint8_t fc, uint8_t reg);	// value of a Modbus register
+uint8_t mbwrite(uint8_t reg, uint16_t v);	// write a Modbus holding register, returns an exception code
+void mbputbyte(uint8_t b);		// send a byte of a Modbus answer
+#endif
+#if COMMANDS || MODBUS
+void setshort(uint8_t n);		// change the length of the fast mode window
+void resetcounts(void);			// clear all counters and averages
+#endif
+#if TRIM
+void settrim(int16_t ppm);		// change the clock trim and save it in EEPROM
+#endif
+#if DOSE
+void adddose(uint32_t n);		// add a second's counts to the dose
+void savedose(void);			// save the dose in EEPROM
+void loaddose(void);			// restore the dose from EEPROM
+void cleardose(void);			// reset the dose
+uint16_t dosecrc(struct dosesave *d);	// CRC of a dose checkpoint
+#endif
+void sendreport(uint8_t tick);		// log data over the serial port, tick = 1 once a second
+void sendline(void);			// send the next part of the CSV report
+#if BINARY_REPORT || COMMANDS
+void sendframe(void);			// log data over the serial port in binary format
+#if DOSE
+void senddose(void);			// send the total and dose in binary format
+#endif
+void sendcobs(uint8_t *p, uint8_t len);	// send a binary frame with its CRC, COBS encoded
+#endif
+uint32_t usv(const struct calpoint *p, uint32_t cpm);	// convert CPM to uSv/hr x100,000 with calibration curve p
+#if UNC_K
+uint32_t usvunc(void);			// uncertainty of the reported uSv/hr x100,000
+#endif
+#if BINARY_REPORT || COMMANDS || MODBUS
+uint16_t usvx100(uint32_t v);		// convert uSv/hr x100,000 to x100
+#endif
+void uart_putusv(uint32_t v);		// send uSv/hr x100,000 with 2 decimals
+#if COMMANDS || MODBUS
+void settube(uint8_t t);		// change the GM tube type and save it in EEPROM
+#endif
+void uart_putfixed(uint32_t v, uint8_t frac, uint8_t dec);	// send a fixed point number
+
+// Global constants
+#if COMMANDS
+#define BAUD_ENTRY(b)	{ b, BAUD_UBRR(b) | (BAUD_U2X(b) ? 0x8000 : 0) },
+const struct baud baudtab[] PROGMEM = { BAUD_TABLE(BAUD_ENTRY) };
+#endif
+
+// Calibration curves, from information collected from the web (may not be accurate)
+const struct calpoint caltab[][CAL_POINTS] PROGMEM = {
+	{ { 0, 570 } },			// 0: SBM-20 (0.0057 uSv/hr per CPM)
+	{ { 0, 210 } },			// 1: SBM-19 (0.0021)
+	{ { 0, 812 } },			// 2: J305, M4011 (0.00812)
+};
+#define TUBES	(sizeof(caltab) / sizeof(caltab[0]))
+
+const uint32_t pow10tab[] PROGMEM = {	// powers of ten for uart_putfixed()
+	1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10, 1
+};
 
 // Global variables
 volatile uint8_t nobeep;		// flag used to mute beeper
 volatile uint16_t count;		// number of GM events that has occurred
-volatile uint16_t slowcpm;		// GM counts per minute in slow mode
-volatile uint16_t fastcpm;		// GM counts per minute in fast mode
-volatile uint16_t cps;			// GM counts per second, updated once a second
-volatile uint8_t overflow;		// overflow flag
-
-volatile uint8_t buffer[LONG_PERIOD];	// the sample buffer
-volatile uint8_t idx;			// sample buffer index
-
-volatile uint8_t eventflag;		// flag for ISR to tell main loop if a GM event has occurred
-volatile uint8_t tick;			// flag that tells main() when 1 second has passed
-
-char serbuf[SER_BUFF_LEN];		// serial buffer
-uint8_t mode;				// logging mode, 0 = slow, 1 = fast, 2 = inst
+#if COUNT_HW
+volatile uint8_t count_hi;		// Timer0 overflows, high byte of the hardware event count
+#endif
+volatile uint16_t sample;		// GM events in the last second, see update()
+volatile uint8_t tickseq;		// incremented by ISR(TIMER1_COMPA_vect) every second
+uint8_t lastseq;			// last tickseq handled by update()
+uint8_t missed;				// number of seconds update() was too late for
+
+uint32_t slowcpm;			// GM counts per minute in slow mode
+#if COMMANDS || MODBUS
+uint32_t fastsum;			// sum of the last shortperiod samples, x fastscale = fast mode CPM
+uint8_t shortperiod;			// # of samples for fast avg mode
+uint8_t fastscale;			// LONG_PERIOD/shortperiod, converts fastsum to CPM
+uint8_t zlimit;				// change detection threshold, in tenths of a standard deviation
+#else
+uint16_t fastsum;			// the same, SHORT_PERIOD samples always fit in 16 bits
+#define shortperiod	SHORT_PERIOD	// without commands the settings are constants, which saves SRAM
+#define fastscale	(LONG_PERIOD/SHORT_PERIOD)
+#define zlimit		CHANGE_Z
+#endif
+uint8_t age;				// # of samples in the average since the last change, LONG_PERIOD in slow mode
+uint8_t valid;				// # of samples since power up, up to LONG_PERIOD (the report is in warm-up below that)
+
+uint8_t buffer[LONG_PERIOD];		// the sample buffer, see packsample()
+uint8_t idx;				// sample buffer index
+
+#if CASCADE
+uint16_t minbuf[CASCADE_MIN];		// CPM of the last CASCADE_MIN minutes
+uint16_t hourbuf[CASCADE_HOUR];		// average CPM of the last CASCADE_HOUR minbuf windows
+uint8_t minidx;				// minbuf index
+uint8_t houridx;			// hourbuf index
+uint8_t minvalid;			// # of minutes in minbuf since the last reset, up to CASCADE_MIN
+uint8_t hourvalid;			// # of entries in hourbuf since the last reset, up to CASCADE_HOUR
+#endif
+
+#if FIXED_COUNT
+volatile uint16_t fctarget;		// counts per fixed count measurement, 0 = off
+uint16_t fccount;			// counts of the measurement before the current second, less count at its start
+uint16_t fcticks;			// Timer1 ticks since the start of the measurement
+volatile uint16_t fcn;			// counts in the last measurement
+volatile uint16_t fct;			// its length in Timer1 ticks
+#if BINARY_REPORT || COMMANDS || MODBUS
+volatile uint8_t fcseq;			// incremented by ISR(TIMER1_COMPA_vect) after every measurement
+#endif
+#endif
+
+volatile uint8_t flashcnt;		// Timer0 compare matches left until the flash/click ends
+// Some state lives in the general purpose I/O registers, which saves SRAM (and sbi/cbi set or clear
+// a bit of GPIOR0 in one instruction, so the main loop can change a flag without disabling interrupts)
+#define flags		GPIOR0		// flag bits:
+#define EVENT		0		// set by ISR(INT0_vect) to tell main loop a GM event has occurred
+#define PRESSED		1		// debounced button state
+#define FCDONE		2		// set by ISR(TIMER1_COMPA_vect) when a fixed count measurement has ended
+#define CALSTARTED	3		// a clock calibration was started with C
+#define subtick		GPIOR1		// Timer1 interrupts since the last second
+#define button		GPIOR2		// last 8 samples of the button, 1 = pressed
+
+#if TX_BUFF_LEN
+volatile char txbuf[TX_BUFF_LEN];	// UART transmit ring buffer
+volatile uint8_t txhead;		// next free position in txbuf
+volatile uint8_t txtail;		// next character to send from txbuf
+uint8_t txoverflow;			// number of characters dropped because txbuf was full
+#endif
+#if COMMANDS || MULTIDROP
+volatile uint8_t txbusy;		// flag, the UART is sending, cleared by ISR(USART_TX_vect)
+#endif
+struct report report;			// latest report, see update()
+uint8_t tube;				// GM tube type, index of caltab
+uint8_t eetube EEMEM;			// saved tube type, 0xFF (erased) = TUBE
+#if COMMANDS
+uint8_t binary;				// flag, send binary frames instead of CSV
+#else
+#define binary		BINARY_REPORT
+#endif
+#if COMMANDS || MODBUS
+uint8_t interval;			// report interval in seconds, 0 = only when asked
+uint8_t elapsed;			// seconds since the last report
+#else
+#define interval	1
+#endif
+uint8_t sendnow;			// 1 = send a report, +2 = send a dose frame first (binary only)
+uint8_t sending;			// next part of the CSV report sendline() sends, 0 = none
+
+#if COMMANDS
+volatile char rxbuf[RX_BUFF_LEN];	// serial command buffer, filled by ISR(USART_RX_vect)
+volatile uint8_t rxlen;			// # of characters in rxbuf
+volatile uint8_t rxready;		// flag, rxbuf holds a complete command
+uint8_t dumping;			// # of samples senddump() still has to send
+uint8_t dumpidx;			// next sample senddump() sends
+#endif
+#if MULTIDROP
+uint8_t address;			// bus address, 0 = point to point
+uint8_t eeaddress EEMEM;		// saved bus address, 0xFF (erased) = 0
+#endif
+#if TRIM
+volatile int16_t trim;			// clock trim in ppm, positive if the crystal is fast
+int16_t trimacc;			// correction accumulated by ISR(TIMER1_COMPA_vect), in ppm of a period
+uint16_t eetrim EEMEM;			// saved trim, inverted so an erased EEPROM means 0
+#if COMMANDS
+uint16_t calsecs;			// seconds since the C command that started the calibration, wraps
+volatile uint16_t rxsecs;		// calsecs when the last command line ended
+volatile uint16_t rxticks;		// and the Timer1 ticks into that second
+uint16_t calticks;			// rxticks of the C command that started the calibration
+#endif
+#endif
+#if DOSE
+uint32_t total;				// total counts since the last cleardose()
+uint32_t dose;				// dose in nSv since the last cleardose()
+uint32_t dosefrac;			// remainder of the dose, in 1/DOSE_DIV nSv
+uint16_t dosesecs;			// seconds since the last savedose()
+uint8_t doseslot;			// eedose slot savedose() writes next
+struct dosesave eedose[2] EEMEM;	// the two last dose checkpoints
+#endif
+#if MODBUS
+volatile uint8_t mbbuf[MB_BUFF_LEN];	// start of the Modbus frame being received, filled by ISR(USART_RX_vect)
+volatile uint8_t mblen;			// # of bytes received in this frame
+volatile uint16_t mbrxcrc;		// CRC of the bytes received, 0 at the end of a good frame
+volatile uint16_t mblast;		// timestamp() of the last byte received
+uint16_t mbcrc;				// CRC of the answer being sent
+#endif
+
+#if TIMESTAMPS || MODBUS
+volatile uint16_t t1base;		// timestamp() at the start of the current Timer1 period
+#endif
+#if TIMESTAMPS
+volatile uint16_t tsbuf[TS_BUFF_LEN];	// event timestamp ring buffer, filled by ISR(INT0_vect)
+volatile uint8_t tshead;		// next free position in tsbuf
+uint8_t tstail;				// next timestamp to send from tsbuf
+volatile uint16_t tsdropped;		// events dropped because tsbuf was full
+uint16_t tsprev;			// timestamp() at the last call of sendstamps()
+uint32_t tsnow;				// the same, extended to 32 bits
+uint32_t tslast;			// time of the last event sent
+#endif
 
 
 // Interrupt service routines
 
+#if COUNT_HW
+// Timer0 overflow interrupt
+// Timer0 is clocked by GM pulses on the T0 pin, this is called every 256 events.
+ISR(TIMER0_OVF_vect)
+{
+	if (count_hi < UINT8_MAX)	// cap the counts at max possible, just like ISR(INT0_vect)
+		count_hi++;
+}
+#else
 // Pin change interrupt for pin INT0
 // This interrupt is called on the falling edge of a GM pulse.
 ISR(INT0_vect)
 {
+	uint16_t end;	// Timer1 count at which the PULSE output goes low again
+
+#if TIMESTAMPS
+	// note the arrival time first, for the best accuracy
+	uint8_t next = (tshead + 1) & (TS_BUFF_LEN - 1);
+	if (next == tstail) {	// sendstamps() can't keep up
+		if (tsdropped < UINT16_MAX)
+			tsdropped++;
+	} else {
+		tsbuf[tshead] = timestamp();
+		tshead = next;
+	}
+#endif
+
 	if (count < UINT16_MAX)	// check for overflow, if we do overflow just cap the counts at max possible
 		count++; // increase event counter
 
 	// send a pulse to the PULSE connector
-	// a delay of 100us limits the max CPS to about 8000
-	// you can comment out this code and increase the max CPS possible (up to 65535!)
+	// instead of waiting here, let a Timer1 compare match end the pulse
+	// a new event while the pulse is still high just extends it
+	end = TCNT1 + PULSE_TICKS;
+	if (end > OCR1A)		// Timer1 counts from 0 to OCR1A (CTC mode), so wrap around
+		end -= OCR1A + 1;
+	OCR1B = end;
+	TIFR = _BV(OCF1B);		// clear any stale compare flag
+	TIMSK |= _BV(OCIE1B);		// enable the compare interrupt that ends the pulse
 	PORTD |= _BV(PD6);	// set PULSE output high
-	_delay_us(PULSEWIDTH);
+
+	flags |= _BV(EVENT);	// tell main program loop that a GM pulse has occurred
+}
+
+// Timer1 compare B interrupt
+// This interrupt ends the PULSE output started in ISR(INT0_vect).
+ISR(TIMER1_COMPB_vect)
+{
 	PORTD &= ~(_BV(PD6));	// set pulse output low
+	TIMSK &= ~(_BV(OCIE1B));	// one-shot, wait for the next GM event
+}
 
-	eventflag = 1;	// tell main program loop that a GM pulse has occurred
+// Timer0 compare interrupt
+// Timer0 runs while the LED is on, and toggles the piezo unless we're muted.
+// This interrupt is called every TONE_TOP+1 us and ends the flash once flashcnt runs out.
+ISR(TIMER0_COMPA_vect)
+{
+	if (--flashcnt == 0) {
+		PORTB &= ~(_BV(PB4));	// turn off the LED
+		TCCR0B = 0;				// disable Timer0 since we're no longer using it
+		TCCR0A &= ~(_BV(COM0A0));	// disconnect OCR0A from Timer0, this avoids occasional HVPS whine after beep
+	}
+}
+#endif
+
+#if TX_BUFF_LEN
+// UART data register empty interrupt
+// This interrupt is enabled by uart_putchar() and sends the next character from txbuf.
+ISR(USART_UDRE_vect)
+{
+	// uart_putbyte() publishes txhead before it sets UDRIE, if we ran in between and emptied
+	// the buffer, UDRIE is set again with nothing queued
+	if (txtail == txhead) {
+		UCSRB &= ~(_BV(UDRIE));
+		return;
+	}
+	UDR = txbuf[txtail];	// send 1 character
+	txtail = (txtail + 1) & (TX_BUFF_LEN - 1);
+	if (txtail == txhead)	// buffer empty, we're done for now
+		UCSRB &= ~(_BV(UDRIE));
+}
+#endif
+
+#if COMMANDS || MULTIDROP
+// UART transmit complete interrupt
+// The last character has left the shift register, so the line is free (and the baud rate can be changed).
+ISR(USART_TX_vect)
+{
+	if (txtail == txhead) {	// nothing was queued in the meantime
+		txbusy = 0;
+#if MULTIDROP
+		PORTD &= ~(_BV(DE_PIN));	// release the bus
+#endif
+	}
+}
+#endif
+
+#if COMMANDS
+// UART receive interrupt
+// Collect a line of text in rxbuf, and tell checkcommand() when it's complete.
+ISR(USART_RX_vect)
+{
+	char c = UDR;
+
+	if (rxready)	// the last command wasn't handled yet, ignore this one
+		return;
+	if (c == '\r' || c == '\n') {	// end of the line
+		if (rxlen) {
+			if (rxlen >= RX_BUFF_LEN)	// too long, make sure it isn't understood
+				rxlen = 0;
+			rxbuf[rxlen] = '\0';
+			rxready = 1;
+#if TRIM
+			// note the time, for the C command
+			uint16_t t = TCNT1;
+			if ((TIFR & _BV(OCF1A)) && t < T1_TOP/2)	// Timer1 wrapped, but its interrupt didn't run yet
+				t += OCR1A + 1;
+			rxsecs = calsecs;
+			rxticks = subtick * (T1_TOP+1) + t;
+#endif
+		}
+	} else if (rxlen < RX_BUFF_LEN) {
+		if (rxlen < RX_BUFF_LEN - 1)
+			rxbuf[rxlen] = c;
+		rxlen++;	// rxlen = RX_BUFF_LEN means too long
+	}
 }
+#endif
 
-// Pin change interrupt for pin INT1 (pushbutton)
-// If the user pushes the button, this interrupt is executed.
-// We need to be careful about switch bounce, which will make the interrupt
-// execute multiple times if we're not careful.
-ISR(INT1_vect)
+#if MODBUS
+// UART receive interrupt
+// Collect a Modbus frame: a gap of more than MB_T35 starts a new one.  Only the start of the frame is
+// stored, but the CRC is checked over all of it.  checkmodbus() takes the frame once the line is quiet.
+ISR(USART_RX_vect)
 {
-	_delay_ms(25);			// slow down interrupt calls (crude debounce)
-	if ((PIND & _BV(PD3)) == 0)	// is button still pressed?
-		nobeep ^= 1;		// toggle mute mode
-	EIFR |= _BV(INTF1);		// clear interrupt flag to avoid executing ISR again due to switch bounce
+	uint8_t c = UDR;
+	uint16_t now = timestamp();
+
+	if (txbusy)	// our own answer, if the transceiver echoes it
+		return;
+	if ((uint16_t)(now - mblast) > MB_T35)	// silence, this is the start of a new frame
+		mblen = 0;
+	mblast = now;
+	if (mblen == 0)
+		mbrxcrc = 0xFFFF;
+	mbrxcrc = _crc16_update(mbrxcrc, c);
+	if (mblen < MB_BUFF_LEN)
+		mbbuf[mblen] = c;
+	if (mblen < UINT8_MAX)
+		mblen++;
 }
+#endif
 
 // Timer1 compare interrupt
 // This interrupt is called every time TCNT1 reaches OCR1A and is reset back to 0 (CTC mode).
-// Timer1 is setup so this happens once a second.
+// Timer1 is setup so this happens TICKS_PER_SEC times a second.
 ISR(TIMER1_COMPA_vect)
 {
-	uint8_t i;	// index for fast mode
-	tick = 1;	// update flag
+#if TIMESTAMPS || MODBUS
+	t1base += OCR1A + 1;	// keep timestamp() running
+#endif
+
+#if TRIM
+	// Correct the crystal error: make the next period a tick longer or shorter whenever the
+	// accumulated correction reaches a whole tick (TRIM_TICK ppm of a period)
+	trimacc += trim;
+	if (trimacc >= TRIM_TICK) {
+		trimacc -= TRIM_TICK;
+		OCR1A = T1_TOP + 1;
+	} else if (trimacc <= -TRIM_TICK) {
+		trimacc += TRIM_TICK;
+		OCR1A = T1_TOP - 1;
+	} else {
+		OCR1A = T1_TOP;
+	}
+#endif
+
+	// Sample the pushbutton, we need to be careful about switch bounce
+	// so only act once the last 4 samples agree.
+	button = (button << 1) | ((PIND & _BV(PD3)) == 0);
+	if ((button & 0x0F) == 0x0F) {
+		if (!(flags & _BV(PRESSED))) {
+			flags |= _BV(PRESSED);
+			nobeep ^= 1;		// toggle mute mode
+		}
+	} else if ((button & 0x0F) == 0) {
+		flags &= ~_BV(PRESSED);
+	}
+
+#if COUNT_HW
+	PORTB &= ~(_BV(PB4));	// end the LED flash from the last second
+#endif
+
+#if FIXED_COUNT
+	// End the fixed count measurement once it has enough counts, or takes too long
+	// (with COUNT_HW the counts only show up once a second, one tick late)
+	if (fctarget) {
+		uint16_t n = fccount + count;
+		fcticks++;
+		if (n >= fctarget || fcticks >= FC_MAXTIME*(uint16_t)TICKS_PER_SEC) {
+			fcn = n;		// hand it over to fixedcount()
+			fct = fcticks;
+#if BINARY_REPORT || COMMANDS || MODBUS
+			fcseq++;
+#endif
+			flags |= _BV(FCDONE);
+			fccount = -count;	// and start the next one
+			fcticks = 0;
+		}
+	}
+#endif
+
+	if (++subtick < TICKS_PER_SEC)
+		return;		// the rest is done once a second
+	subtick = 0;
+#if TRIM && COMMANDS
+	calsecs++;
+#endif
 
 	//PORTB ^= _BV(PB4);	// toggle the LED (for debugging purposes)
-	cps = count;
-	slowcpm -= buffer[idx];		// subtract oldest sample in sample buffer
 
-	if (count > UINT8_MAX) {	// watch out for overflowing the sample buffer
-		count = UINT8_MAX;
-		overflow = 1;
+#if COUNT_HW
+	// collect the events counted by Timer0 since the last tick
+	uint8_t lo = TCNT0;
+	TCNT0 = 0;
+	if (TIFR & _BV(TOV0)) {		// overflow not handled yet
+		TIFR = _BV(TOV0);
+		if (lo < 0x80 && count_hi < UINT8_MAX)	// only if it happened before we read TCNT0
+			count_hi++;
 	}
+	count = ((uint16_t)count_hi << 8) | lo;
+	count_hi = 0;
+	if (count)
+		PORTB |= _BV(PB4);	// flash the LED until the next Timer1 tick
+#endif
+
+	// hand the count over to update(), the averaging is done with interrupts enabled
+	// bumping tickseq tells it there is a new sample (and makes it read again if we interrupted it)
+	sample = count;
+#if FIXED_COUNT
+	fccount += count;
+#endif
+	count = 0;  // reset counter
+	tickseq++;	// tell main() a new sample is ready
+}
 
-	slowcpm += count;			// add current sample
-	buffer[idx] = count;	// save current sample to buffer (replacing old value)
+// Functions
 
-	// Compute CPM based on the last SHORT_PERIOD samples
-	fastcpm = 0;
-	for(i=0; i<SHORT_PERIOD;i++) {
-		int8_t x = idx - i;
-		if (x < 0)
-			x = LONG_PERIOD + x;
-		fastcpm += buffer[x];	// sum up the last 5 CPS values
-	}
-	fastcpm = fastcpm * (LONG_PERIOD/SHORT_PERIOD);	// convert to CPM
+// Add the last second to the averages
+// This is called from the main loop and does nothing until ISR(TIMER1_COMPA_vect) has a new sample.
+// Returns 1 if a second has passed.
+uint8_t update(void)
+{
+	uint8_t seq;	// tickseq of the sample we're handling
+	uint16_t n;	// counts in the last second
+	uint8_t old;	// index of the sample that drops out of the fast mode window
+	uint8_t s;	// current sample in sample buffer format
+	uint16_t cps;	// n, before it is limited to SAMPLE_MAX
+	uint32_t agesum;	// sum of the last age samples
+#if UNC_K
+	uint32_t wn;	// counts in the window the reported CPM is based on
+	uint8_t wt;	// and its length in seconds
+#endif
+
+	if (sending)
+		return 0;	// sendline() is still sending the report, the sample waits
+
+	do {	// if ISR(TIMER1_COMPA_vect) ran while we were reading, read again
+		seq = tickseq;
+		n = sample;
+	} while (seq != tickseq);
+	if (seq == lastseq)
+		return 0;	// nothing new yet
+
+	// if we fell behind, the samples in between were overwritten
+	seq -= lastseq;		// seconds since the last update, normally 1
+	lastseq += seq;
+	seq--;
+	missed = (missed > UINT8_MAX - seq) ? UINT8_MAX : missed + seq;
+
+	cps = n;
+
+#if DOSE
+	// Add this second to the dose, corrected for dead time like the report
+#if DEADTIME
+	adddose(deadtime(cps, DT_CPS, DT_CPS_MAX));
+#else
+	adddose(cps);
+#endif
+#endif
+	slowcpm -= unpacksample(buffer[idx]);	// subtract oldest sample in sample buffer
+
+	if (n > SAMPLE_MAX)	// watch out for overflowing the sample buffer
+		n = SAMPLE_MAX;
+
+	// from here on use the value as stored, so that subtracting it later cancels out exactly
+	s = packsample(n);
+	n = unpacksample(s);
+
+	slowcpm += n;			// add current sample
+	buffer[idx] = s;	// save current sample to buffer (replacing old value)
+
+	// Compute CPM based on the last shortperiod samples
+	// Like slowcpm this is a running sum, add the current sample and subtract
+	// the one from shortperiod seconds ago, so the cost doesn't depend on shortperiod.
+	old = (idx >= shortperiod) ? idx - shortperiod : idx + LONG_PERIOD - shortperiod;
+	fastsum += n;
+	fastsum -= unpacksample(buffer[old]);
 
 	// Move to the next entry in the sample buffer
 	idx++;
-	if (idx >= LONG_PERIOD)
+	if (idx >= LONG_PERIOD) {
 		idx = 0;
-	count = 0;  // reset counter
+#if CASCADE
+		cascade(slowcpm);	// the buffer now holds exactly the last minute
+#endif
+	}
+
+	// Grow the average since the last change by this sample, up to the whole buffer
+	// At power up (age = valid = 0) the buffer is empty, so this also leaves out the samples we don't have yet.
+	// Unlike slowcpm and fastsum, its sum is worked out from the buffer every time, which saves 4 bytes of SRAM.
+	if (valid < LONG_PERIOD)
+		valid++;
+	if (age < LONG_PERIOD)
+		age++;
+	agesum = bufsum(age);
+
+	// Check if the last shortperiod samples (F counts) fit the average of the last age samples (A counts).
+	// If the rate didn't change, F is Poisson distributed around A*S/age, and d = F*age - A*S has a
+	// variance of A*S*(age - S) (S = shortperiod).  If d is too big, the rate changed: start a new average.
+	if (age > shortperiod) {
+		int32_t d = (uint32_t)fastsum*age - agesum*shortperiod;
+		uint32_t v = (uint32_t)shortperiod * (age - shortperiod) * (agesum ? agesum : 1);
+
+		if (d < 0)
+			d = -d;
+		if ((uint32_t)d*10 > (uint32_t)zlimit * isqrt(v)) {
+			age = shortperiod;
+			agesum = fastsum;
+		}
+	}
+
+#if FIXED_COUNT
+	if (fctarget)	// fixedcount() does the reporting
+		return 1;
+#endif
+
+	// Pick the CPM value to report
+#if BINARY_REPORT || COMMANDS || MODBUS
+	report.seq = lastseq;
+#endif
+	report.cps = cps;
+	if (cps > SAMPLE_MAX) {	// too much for the sample buffer
+		report.cpm = report.cps*60UL;
+		report.mode = 2;
+#if UNC_K
+		wn = cps;
+		wt = 1;
+#endif
+	}
+	else {
+		report.mode = (age < valid);	// FAST if the rate changed recently, else SLOW
+		if (age < LONG_PERIOD)
+			report.cpm = agesum * 60 / age;	// report cpm based on the last age samples
+		else
+			report.cpm = slowcpm;	// report cpm based on last 60 samples
+#if UNC_K
+		wn = agesum;	// this is slowcpm when age = LONG_PERIOD
+		wt = age;
+#endif
+	}
+
+#if UNC_K
+	uint32_t raw = report.cpm;	// the measured rate, for uncertainty()
+#endif
+#if DEADTIME
+	// Correct for the events the tube (and ISR(INT0_vect)) missed
+	uint32_t c = deadtime(report.cps, DT_CPS, DT_CPS_MAX);
+	report.cps = (c > UINT16_MAX) ? UINT16_MAX : c;
+	report.cpm = deadtime(report.cpm, DT_CPM, DT_CPM_MAX);
+#endif
+#if UNC_K
+	report.unc = uncertainty(report.cpm, raw, wn, wt * TICKS_PER_SEC);
+#endif
+	return 1;
 }
 
-// Functions
+#if TRIM
+// Change the clock trim to ppm (positive if the crystal is fast) and save it in EEPROM
+void settrim(int16_t ppm)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		trim = ppm;
+	}
+	eeprom_update_word(&eetrim, ~ppm);
+}
+#endif
 
-// Send a character to the UART
-void uart_putchar(char c)
+#if DOSE
+// Add n counts (one second's worth) to the total and the dose
+// The dose is usv(n * 60) / DOSE_DIV nSv, the remainder is kept so nothing is lost to rounding.
+// Every DOSE_SAVE minutes the dose is saved in EEPROM.
+void adddose(uint32_t n)
 {
-	if (c == '\n') uart_putchar('\r');	// Windows-style CRLF
+	uint32_t d;
+	uint32_t q;
+
+	total = (total > UINT32_MAX - n) ? UINT32_MAX : total + n;
+	d = usv(caltab[tube], n * 60);	// n is at most 16 * 65535, so this fits
+	if (d > UINT32_MAX - DOSE_DIV)	// saturated
+		d = UINT32_MAX - DOSE_DIV;
+	d += dosefrac;
+	q = d / DOSE_DIV;
+	dosefrac = d - q * DOSE_DIV;
+	dose = (dose > UINT32_MAX - q) ? UINT32_MAX : dose + q;
+
+	if (++dosesecs >= DOSE_SAVE*60U) {
+		dosesecs = 0;
+		savedose();
+	}
+}
 
-	loop_until_bit_is_set(UCSRA, UDRE);	// wait until UART is ready to accept a new character
-	UDR = c;							// send 1 character
+// Save the dose in EEPROM
+// The two slots are written in turn, so if the power fails during a write the other one is still good.
+// eeprom_update_block() only writes the bytes that changed, which saves wear and time.
+void savedose(void)
+{
+	struct dosesave d;
+
+	d.total = total;
+	d.dose = dose;
+	d.crc = dosecrc(&d);
+	eeprom_update_block(&d, &eedose[doseslot], sizeof(d));
+	doseslot ^= 1;
 }
 
-// Send a string in SRAM to the UART
-void uart_putstring(char *buffer)
+// Restore the dose from the newest good checkpoint in EEPROM
+// The totals only grow, so the newest checkpoint is the one with the higher total.
+// An erased EEPROM has no good checkpoints, then the dose starts at 0.
+void loaddose(void)
 {
-	// start sending characters over the serial port until we reach the end of the string
-	while (*buffer != '\0') {	// are we at the end of the string yet?
-		uart_putchar(*buffer);	// send the contents
-		buffer++;				// advance to next char in buffer
+	struct dosesave d;
+	uint8_t i;
+
+	for (i = 0; i < 2; i++) {
+		eeprom_read_block(&d, &eedose[i], sizeof(d));
+		if (d.crc == dosecrc(&d) && d.total >= total) {
+			total = d.total;
+			dose = d.dose;
+			doseslot = i ^ 1;	// keep this one, write the other one next
+		}
+	}
+}
+
+// Reset the dose and the total count, in EEPROM as well
+void cleardose(void)
+{
+	total = 0;
+	dose = 0;
+	dosefrac = 0;
+	dosesecs = 0;
+	savedose();	// overwrite both checkpoints
+	savedose();
+}
+
+// Return the CRC of a dose checkpoint, without its crc field
+uint16_t dosecrc(struct dosesave *d)
+{
+	uint8_t *p = (uint8_t *)d;
+	uint16_t crc = 0xFFFF;
+	uint8_t i;
+
+	for (i = 0; i < sizeof(*d) - sizeof(d->crc); i++)
+		crc = _crc16_update(crc, p[i]);
+	return crc;
+}
+#endif
+
+// Integer square root, rounded down
+// Bit by bit, like long division, so it only needs shifts and subtractions.
+uint16_t isqrt(uint32_t v)
+{
+	uint32_t r = 0;		// root so far, shifted left by the bits still to find
+	uint32_t b = 1UL << 30;	// current bit of the root, squared
+
+	while (b > v)
+		b >>= 2;
+	while (b) {
+		if (v >= r + b) {
+			v -= r + b;
+			r = (r >> 1) + b;
+		} else {
+			r >>= 1;
+		}
+		b >>= 2;
+	}
+	return r;
+}
+
+#if UNC_K
+// Return the counting uncertainty of cpm, a rate based on n counts in t Timer1 ticks
+// raw is the measured rate cpm was corrected from.  n counts are uncertain by sqrt(n), or 1/sqrt(n) of
+// the rate.  The dead time correction scales the relative uncertainty by 1/(1 - raw*DEADTIME), which
+// is cpm/raw.  The result is UNC_K/10 standard deviations.
+uint32_t uncertainty(uint32_t cpm, uint32_t raw, uint32_t n, uint16_t t)
+{
+	uint32_t u;
+	uint16_t q;	// cpm/raw, x256
+	uint16_t r;
+
+	if (n == 0) {	// nothing counted, use the rate of a single count
+		cpm = (60UL*TICKS_PER_SEC + t/2) / t;
+		raw = cpm;
+		n = 1;
+	}
+	r = isqrt(n << 8);	// 16 * sqrt(n)
+	u = (cpm*16 + r/2) / r;
+
+	if (cpm > raw) {	// corrected for dead time, at most 16x
+		q = (cpm < (1UL << 24)) ? (cpm << 8) / raw : cpm / (raw >> 8);
+		if (u < (1UL << 20))	// make sure u*q fits in 32 bits
+			u = (u * q) >> 8;
+		else if ((u >> 8) > UINT32_MAX / q)
+			u = UINT32_MAX;
+		else
+			u = (u >> 8) * q;
+	}
+	return u * UNC_K / 10;
+}
+#endif
+
+#if FIXED_COUNT
+// Build the report when ISR(TIMER1_COMPA_vect) has ended a fixed count measurement
+// The rates are averages over the whole measurement: counts / ticks, scaled to CPS and CPM.
+void fixedcount(void)
+{
+	uint16_t n;	// counts of the measurement
+	uint16_t t;	// and its length in ticks
+	uint32_t c;
+
+	if (sending || !(flags & _BV(FCDONE)))
+		return;		// nothing new yet, or don't change the report while sendline() is sending it
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {	// take it before ISR(TIMER1_COMPA_vect) ends the next one
+		flags &= ~_BV(FCDONE);
+		n = fcn;
+		t = fct;
+#if BINARY_REPORT || COMMANDS || MODBUS
+		report.seq = fcseq;
+#endif
+	}
+	if (!fctarget)	// switched off in the meantime
+		return;
+
+	c = (uint32_t)n * TICKS_PER_SEC;	// counts x ticks per second
+	report.mode = 3;
+	report.cpm = c * 60 / t;
+	c = (c + t/2) / t;
+	report.cps = (c > UINT16_MAX) ? UINT16_MAX : c;
+#if UNC_K
+	uint32_t raw = report.cpm;	// the measured rate, for uncertainty()
+#endif
+
+#if DEADTIME
+	c = deadtime(report.cps, DT_CPS, DT_CPS_MAX);
+	report.cps = (c > UINT16_MAX) ? UINT16_MAX : c;
+	report.cpm = deadtime(report.cpm, DT_CPM, DT_CPM_MAX);
+#endif
+#if UNC_K
+	report.unc = uncertainty(report.cpm, raw, n, t);
+#endif
+
+	if (interval)	// report now, unless we only talk when asked
+		sendnow = 1;
+}
+
+// Start fixed count measurements of n counts, or switch them off (n = 0)
+void setfixed(uint16_t n)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		fctarget = n;
+		fccount = -count;
+		fcticks = 0;
+	}
+}
+#endif
+
+#if DEADTIME
+// Correct a measured count rate for dead time (non-paralyzable model)
+// dt is the dead time per unit of rate as a fraction of 2^32 (DT_CPS or DT_CPM), and max the rate
+// at which 15/16 of the time is dead (DT_CPS_MAX or DT_CPM_MAX).  Returns rate / (1 - rate*dt).
+uint32_t deadtime(uint32_t rate, uint32_t dt, uint32_t max)
+{
+	uint16_t live;	// fraction of the time the counter is live, x65536
+	uint32_t f;	// correction factor, x4096
+
+	if (rate >= max)	// saturated, limit the correction
+		return rate << 4;
+
+	live = ~(rate * dt) >> 16;	// 1 - rate*dt, at least 4096 here
+	f = (1UL << 28) / live;		// 1 / (1 - rate*dt), at most 65536
+
+	if (rate <= UINT16_MAX)		// make sure rate*f fits in 32 bits
+		return (rate * f) >> 12;
+	return ((rate >> 4) * f) >> 8;
+}
+#endif
+
+// Convert a CPS value (0..SAMPLE_MAX) to the 8-bit sample buffer format
+// The top 3 bits are an exponent e, the low 5 bits a mantissa m.
+// e = 0 stores m, otherwise the value is (32 + m) << (e - 1), see unpacksample().
+uint8_t packsample(uint16_t n)
+{
+	uint8_t e = 1;	// exponent
+
+	if (n < 32)
+		return n;	// small values are stored as is
+
+	while (n >= 64 << (e - 1))	// find the exponent
+		e++;
+	if (e > 1) {
+		n = (n + (1 << (e - 2))) >> (e - 1);	// round to nearest
+		if (n == 64) {	// rounding carried into the next exponent
+			n = 32;
+			e++;
+		}
 	}
+	return (e << 5) | (n - 32);
+}
+
+// Convert an 8-bit sample back to CPS, see packsample()
+uint16_t unpacksample(uint8_t s)
+{
+	uint8_t e = s >> 5;
+
+	if (e == 0)
+		return s;
+	return (uint16_t)(32 + (s & 31)) << (e - 1);
+}
+
+// Sum of the newest n samples in the sample buffer
+uint32_t bufsum(uint8_t n)
+{
+	uint32_t sum = 0;
+	uint8_t i = idx;
+
+	while (n--) {	// walk back from the newest sample
+		i = i ? i - 1 : LONG_PERIOD - 1;
+		sum += unpacksample(buffer[i]);
+	}
+	return sum;
+}
+
+#if CASCADE
+// Feed the CPM of the last minute into the cascaded averaging windows
+// Every CASCADE_MIN minutes, the average of minbuf moves on to hourbuf.
+void cascade(uint32_t cpm)
+{
+	uint16_t avg;
+
+	if (cpm > UINT16_MAX)	// saturate, the cascade only stores 16 bits
+		cpm = UINT16_MAX;
+	minbuf[minidx] = cpm;
+	if (minvalid < CASCADE_MIN)
+		minvalid++;
+
+	if (++minidx < CASCADE_MIN)
+		return;
+	minidx = 0;
+
+	avg = cascavg(minbuf, CASCADE_MIN, CASCADE_MIN);
+	hourbuf[houridx] = avg;
+	if (hourvalid < CASCADE_HOUR)
+		hourvalid++;
+	if (++houridx >= CASCADE_HOUR)
+		houridx = 0;
+}
+
+// Average of the len entries of a cascade window, of which n have been filled since the last reset
+// (the others are still 0).  The sums aren't kept, adding up a few entries when needed saves SRAM.
+uint16_t cascavg(uint16_t *buf, uint8_t len, uint8_t n)
+{
+	uint32_t sum = 0;
+
+	while (len--)
+		sum += *buf++;
+	return sum / n;
+}
+#endif
+
+// Send a byte to the UART
+// The byte is queued in txbuf, if it is full the byte is dropped.  Without txbuf, wait until the
+// UART can take it.
+void uart_putbyte(uint8_t b)
+{
+#if TX_BUFF_LEN
+	uint8_t next = (txhead + 1) & (TX_BUFF_LEN - 1);
+
+	if (next == txtail) {	// no room left, don't wait for the UART
+		if (txoverflow < UINT8_MAX)
+			txoverflow++;
+		return;
+	}
+	txbuf[txhead] = b;
+	txhead = next;
+#if COMMANDS || MULTIDROP
+	txbusy = 1;
+#endif
+#if MULTIDROP
+	PORTD |= _BV(DE_PIN);	// take the bus, ISR(USART_TX_vect) releases it
+#endif
+	UCSRB |= _BV(UDRIE);	// let ISR(USART_UDRE_vect) send it
+#else
+	loop_until_bit_is_set(UCSRA, UDRE);	// wait until UART is ready to accept a new character
+	UDR = b;
+#endif
+}
+
+// Send a character to the UART
+void uart_putchar(char c)
+{
+	if (c == '\n') uart_putchar('\r');	// Windows-style CRLF
+
+	uart_putbyte(c);
 }
 
 // Send a string in PROGMEM to the UART
@@ -202,133 +1444,1029 @@ void uart_putstring_P(char *buffer)
 		uart_putchar(pgm_read_byte(buffer++));	// read byte from PROGMEM and send it
 }
 
+// Send a number in decimal, without leading zeros
+void uart_putdec(uint32_t v)
+{
+	uart_putfixed(v, 0, 0);
+}
+
+// Wait until everything in the transmit buffer has been sent
+void uart_flush(void)
+{
+#if TX_BUFF_LEN
+	while (txhead != txtail)
+		;
+#endif
+}
+
+#if COMMANDS
+// Change the baud rate to one of the rates in baudtab
+// Anything still in the transmit buffer is sent at the old rate first.
+// Returns 0 (and changes nothing) if the rate isn't in the table.
+uint8_t uart_setbaud(uint32_t rate)
+{
+	uint16_t ubrr = findbaud(rate);
+
+	if (ubrr == 0xFFFF)
+		return 0;
+
+	uart_flush();
+	while (txbusy)	// wait for the last character to leave the shift register
+		;
+	UBRRH = (ubrr >> 8) & 0x0F;
+	UBRRL = ubrr;
+	UCSRA = (ubrr & 0x8000) ? _BV(U2X) : 0;
+	return 1;
+}
+
+// Look up a baud rate in baudtab
+// Returns its UBRR value (bit 15 set if U2X is needed), or 0xFFFF if it isn't in the table.
+uint16_t findbaud(uint32_t rate)
+{
+	uint8_t i;
+
+	for (i = 0; i < sizeof(baudtab)/sizeof(baudtab[0]); i++)
+		if (pgm_read_dword(&baudtab[i].rate) == rate)
+			return pgm_read_word(&baudtab[i].ubrr);
+	return 0xFFFF;
+}
+#endif
+
+// Return the number of bytes that can be queued without dropping any
+// Without txbuf, uart_putbyte() waits instead of dropping, so anything fits.
+uint8_t uart_txfree(void)
+{
+#if TX_BUFF_LEN
+	return (txtail - txhead - 1) & (TX_BUFF_LEN - 1);
+#else
+	return UINT8_MAX;
+#endif
+}
+
+#if TIMESTAMPS
+// Send a number in unsigned LEB128 format, 7 bits at a time, least significant first
+void uart_putvarint(uint32_t v)
+{
+	while (v >= 0x80) {
+		uart_putbyte(v | 0x80);	// more to come
+		v >>= 7;
+	}
+	uart_putbyte(v);
+}
+
+#endif
+
+#if TIMESTAMPS || MODBUS
+// Return the current time in Timer1 ticks (32us), wraps every 2.1 seconds
+// This must be called with interrupts disabled, so t1base can't change.
+uint16_t timestamp(void)
+{
+	uint16_t t = TCNT1;
+
+	if ((TIFR & _BV(OCF1A)) && t < T1_TOP/2)	// Timer1 wrapped, but its interrupt didn't run yet
+		t += OCR1A + 1;
+	return t1base + t;
+}
+#endif
+
+#if TIMESTAMPS
+
+// Send the time since the previous event for every event in tsbuf
+// The timestamps are only 16 bits, so this extends them to 32 bits using the current time.
+// That works as long as this is called at least every 2 seconds, which the Timer1 interrupt ensures.
+void sendstamps(void)
+{
+	uint16_t now;	// current time
+	uint8_t head;	// end of the timestamps that are older than now
+	uint32_t t;	// event time, 32 bits
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		now = timestamp();
+		head = tshead;
+	}
+	tsnow += (uint16_t)(now - tsprev);
+	tsprev = now;
+
+	while (tstail != head && uart_txfree() >= 5) {	// a 32 bit varint is at most 5 bytes
+		t = tsnow - (uint16_t)(now - tsbuf[tstail]);
+		uart_putvarint(t - tslast);
+		tslast = t;
+		tstail = (tstail + 1) & (TS_BUFF_LEN - 1);
+	}
+}
+#endif
+
 // flash LED and beep the piezo
+// This only starts (or extends) the flash, ISR(TIMER0_COMPA_vect) ends it.
 void checkevent(void)
 {
-	if (eventflag) {		// a GM event has occurred, do something about it!
-		eventflag = 0;		// reset flag as soon as possible, in case another ISR is called while we're busy
+#if !COUNT_HW	// the LED is handled by the Timer1 interrupts
+	if (flags & _BV(EVENT)) {	// a GM event has occurred, do something about it!
+		flags &= ~_BV(EVENT);	// reset flag as soon as possible, in case another ISR is called while we're busy
 
-		PORTB |= _BV(PB4);	// turn on the LED
+		flashcnt = FLASH_TICKS;	// (re)start the flash
 
-		if(!nobeep) {		// check if we're in mute mode
-			TCCR0A |= _BV(COM0A0);	// enable OCR0A output on pin PB2
-			TCCR0B |= _BV(CS01);	// set prescaler to clk/8 (1Mhz) or 1us/count
-			OCR0A = 160;	// 160 = toggle OCR0A every 160ms, period = 320us, freq= 3.125kHz
-		}
+		if (TCCR0B == 0) {	// Timer0 is stopped, so this is a new flash
+			PORTB |= _BV(PB4);	// turn on the LED
 
-		// 10ms delay gives a nice short flash and 'click' on the piezo
-		_delay_ms(10);
+			if(!nobeep)		// check if we're in mute mode
+				TCCR0A |= _BV(COM0A0);	// enable OCR0A output on pin PB2
 
-		PORTB &= ~(_BV(PB4));	// turn off the LED
-
-		TCCR0B = 0;				// disable Timer0 since we're no longer using it
-		TCCR0A &= ~(_BV(COM0A0));	// disconnect OCR0A from Timer0, this avoids occasional HVPS whine after beep
+			TCNT0 = 0;
+			TCCR0B = _BV(CS01);	// set prescaler to clk/8 (1Mhz) or 1us/count
+		}
 	}
+#endif
 }
 
 // log data over the serial port
-void sendreport(void)
+// tick is what update() returned: 1 if a second has passed
+void sendreport(uint8_t tick)
 {
-	uint32_t cpm;	// This is the CPM value we will report
-	if(tick) {	// 1 second has passed, time to report data via UART
-		tick = 0;	// reset flag for the next interval
+	if (tick) {	// 1 second has passed
+#if TIMESTAMPS
+		// only send a marker with the number of dropped events
+		uint16_t dropped;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			dropped = tsdropped;
+			tsdropped = 0;
+		}
+		uart_putbyte(0x80);
+		uart_putbyte(0x00);
+		uart_putvarint(dropped);
+		return;	// the marker is sent every second, and replaces the report
+#endif
+
+#if FIXED_COUNT
+		if (!fctarget)	// else fixedcount() decides when to report
+#endif
+#if COMMANDS || MODBUS
+		if (interval && ++elapsed >= interval) {	// time to report data via UART
+			elapsed = 0;
+			sendnow = 1;
+		}
+#else
+		sendnow = 1;	// the interval is 1 second
+#endif
+#if DOSE
+		if (interval && idx == 0)	// once a minute
+			sendnow |= 2;
+#endif
+	}
+
+#if TIMESTAMPS
+	sendnow = 0;	// a report (asked for with ?, or from fixedcount()) would break the stream
+	return;
+#endif
+
+#if COMMANDS
+	if (dumping)	// don't mix the report into a dump, send it afterwards
+		return;
+#endif
+
+	if (sendnow && !sending) {
+#if BINARY_REPORT || COMMANDS
+		if (binary) {
+			if (uart_txfree() < sizeof(struct frame) + 2)	// wait until the whole frame fits
+				return;
+#if DOSE
+			if (sendnow & 2) {
+				sendnow &= ~2;
+				senddose();
+				return;		// the report follows on the next call
+			}
+#endif
+			sendnow = 0;
+			sendframe();
+			return;
+		}
+#endif
+		if (sendnow & 1)	// the CSV line has the dose in it already
+			sending = 1;	// start a CSV line
+		sendnow = 0;
+	}
+	sendline();
+}
 
-		if (overflow) {
-			cpm = cps*60UL;
-			mode = 2;
-			overflow = 0;
+// Send the next part of the CSV report
+// The line is longer than the transmit buffer, so this sends a field at a time (at most TX_FIELD
+// characters) while there is room, and is called again from the main loop until the line is done.
+void sendline(void)
+{
+	while (sending && uart_txfree() >= TX_FIELD) {
+		switch (sending++) {
+		case 1:
+			uart_putstring_P(PSTR("CPS, "));
+			uart_putdec(report.cps);
+			break;
+		case 2:
+			uart_putstring_P(PSTR(", CPM, "));
+			uart_putdec(report.cpm);
+			break;
+		case 3:
+			uart_putstring_P(PSTR(", uSv/hr, "));
+			uart_putusv(usv(caltab[tube], report.cpm));
+			break;
+		case 4:
+			// Tell us what averaging method is being used
+			if (report.mode == 3) {
+				uart_putstring_P(PSTR(", COUNT"));
+			} else if (report.mode == 2) {
+				uart_putstring_P(PSTR(", INST"));
+			} else if (report.mode == 1) {
+				uart_putstring_P(PSTR(", FAST"));
+			} else {
+				uart_putstring_P(PSTR(", SLOW"));
+			}
+			break;
+#if UNC_K
+		case 5:
+			// How far off the values above may be
+			uart_putstring_P(PSTR(", +-, "));
+			uart_putdec(report.unc);
+			break;
+		case 6:
+			uart_putstring_P(PSTR(", "));
+			uart_putusv(usvunc());
+			break;
+#endif
+#if DOSE
+		case 7:
+			// Integrated dose
+			uart_putstring_P(PSTR(", TOTAL, "));
+			uart_putdec(total);
+			break;
+		case 8:
+			uart_putstring_P(PSTR(", DOSE, "));
+			uart_putfixed(dose, 3, 3);	// nSv to uSv
+			break;
+#endif
+#if CASCADE
+		case 9:
+			// Long term averages, over what the windows hold so far
+			uart_putstring_P(PSTR(", CPM10M, "));
+			uart_putdec(minvalid ? cascavg(minbuf, CASCADE_MIN, minvalid) : report.cpm);
+			break;
+		case 10:
+			uart_putstring_P(PSTR(", CPM1H, "));
+			if (hourvalid)
+				uart_putdec(cascavg(hourbuf, CASCADE_HOUR, hourvalid));
+			else
+				uart_putdec(minvalid ? cascavg(minbuf, CASCADE_MIN, minvalid) : report.cpm);
+			break;
+#endif
+		case 11:
+			// Tell us if update() was too late for some seconds
+			if (missed) {
+				uart_putstring_P(PSTR(", MISSED, "));
+				uart_putdec(missed);
+				missed = 0;
+			}
+			break;
+#if TX_BUFF_LEN
+		case 12:
+			// Tell us if characters were lost since the last report
+			if (txoverflow) {
+				uart_putstring_P(PSTR(", TXOVF, "));
+				uart_putdec(txoverflow);
+				txoverflow = 0;
+			}
+			break;
+#endif
+		case 13:
+			// Tell us if the averages don't have LONG_PERIOD seconds of data yet (at the end, so the
+			// other fields don't move; a fixed count measurement stands on its own)
+			if (report.mode != 3 && valid < LONG_PERIOD)
+				uart_putstring_P(PSTR(", WARMUP"));
+			break;
+		case 14:
+			// We're done reporting data, output a newline.
+			uart_putchar('\n');
+			sending = 0;
+			break;
 		}
-		else if (fastcpm > THRESHOLD) {	// if cpm is too high, use the short term average instead
-			mode = 1;
-			cpm = fastcpm;	// report cpm based on last 5 samples
+	}
+}
+
+#if COMMANDS
+// Handle a command received on the serial port, see the list at the top
+void checkcommand(void)
+{
+	char *p;
+	char cmd;
+	uint32_t arg = 0;	// number after the command letter
+	uint8_t hasarg = 0;	// flag, there was a number
+	uint8_t neg = 0;	// flag, the number is negative
+	uint8_t ok = 1;		// 1 = answer OK, 0 = answer ERR, 2 = the command answers itself
+	uint8_t quiet = 0;	// flag, don't answer (a broadcast, or the serial port carries timestamps)
+#if MULTIDROP
+	uint16_t to = address;	// address the command is for, unaddressed commands are only for point to point
+#endif
+
+	if (!rxready || sending || uart_txfree() < 16)	// wait for the end of the report line, and room for the answer
+		return;
+
+	p = (char *)rxbuf;
+#if MULTIDROP
+	if (*p == '@') {	// addressed command
+		p++;
+		to = 0;
+		while (*p >= '0' && *p <= '9' && to < 1000)
+			to = to*10 + (*p++ - '0');
+		while (*p == ' ')
+			p++;
+		quiet = (to == 0);
+	} else if (address) {	// on a bus, only addressed commands count
+		to = UINT16_MAX;
+	}
+	if (to != address && !quiet) {	// for another counter on the bus
+		rxlen = 0;
+		rxready = 0;
+		return;
+	}
+#endif
+	cmd = *p++;
+	if (cmd >= 'a' && cmd <= 'z')	// accept lower case as well
+		cmd -= 'a' - 'A';
+	while (*p == ' ')
+		p++;
+	if (*p == '-') {
+		neg = 1;
+		p++;
+	}
+	while (*p >= '0' && *p <= '9' && arg < 100000000) {
+		arg = arg*10 + (*p++ - '0');
+		hasarg = 1;
+	}
+	if (*p != '\0')	// trailing garbage (or a number that is too big)
+		cmd = '\0';
+	if (neg && (!hasarg || cmd != 'P'))	// only the trim can be negative
+		cmd = '\0';
+#if TIMESTAMPS
+	quiet = 1;	// the timestamp stream must not be interrupted
+#endif
+	if (quiet && (cmd == '?' || cmd == 'D' || (cmd == 'P' && !hasarg)))	// these only send something
+		cmd = '\0';
+
+	switch (cmd) {
+	case '?':	// query, the report is the answer
+		sendnow = 3;	// with a dose frame, if it's binary
+		ok = 2;
+		break;
+	case 'I':	// report interval
+		if (!hasarg || arg > UINT8_MAX)
+			ok = 0;
+		else
+			interval = arg;
+		break;
+	case 'T':	// change detection threshold
+		if (!hasarg || arg == 0 || arg > UINT8_MAX)
+			ok = 0;
+		else
+			zlimit = arg;
+		break;
+	case 'S':	// fast mode window
+		if (!hasarg || arg == 0 || arg >= LONG_PERIOD || LONG_PERIOD % arg)
+			ok = 0;
+		else
+			setshort(arg);
+		break;
+	case 'M':	// mute
+		if (!hasarg)
+			nobeep ^= 1;
+		else if (arg <= 1)
+			nobeep = arg;
+		else
+			ok = 0;
+		break;
+	case 'D':	// dump the sample buffer, senddump() does the work
+		dumping = LONG_PERIOD;
+		dumpidx = idx;	// oldest sample
+		ok = 2;
+		break;
+	case 'R':	// reset
+		resetcounts();
+		break;
+	case 'B':	// baud rate, answer at the old rate before switching
+		if (!hasarg || findbaud(arg) == 0xFFFF) {
+			ok = 0;
+		} else {
+			if (!quiet)
+				uart_putstring_P(PSTR("OK\n"));
+			uart_setbaud(arg);
+			ok = 2;
+		}
+		break;
+	case 'F':	// report format
+		if (!hasarg || arg > 1)
+			ok = 0;
+		else
+			binary = arg;
+		break;
+#if DOSE
+	case 'Z':	// reset the dose
+		cleardose();
+		break;
+#endif
+#if TRIM
+	case 'C':	// clock calibration
+		if (!hasarg) {	// start
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {	// count the seconds from here
+				calsecs -= rxsecs;
+			}
+			calticks = rxticks;
+			flags |= _BV(CALSTARTED);
+		} else if (!(flags & _BV(CALSTARTED)) || arg == 0 || arg > UINT16_MAX) {
+			ok = 0;
 		} else {
-			mode = 0;
-			cpm = slowcpm;	// report cpm based on last 60 samples
+			// Compare the time we measured (in trimmed Timer1 ticks) with arg seconds.  The difference in ppm is
+			// d * 10^6 / (arg * T1_HZ), it fits in 32 bits because it's checked to be less than TRIM_MAX.
+			int32_t d = (int32_t)rxsecs * T1_HZ + rxticks - calticks - (int32_t)arg * T1_HZ;
+			int32_t e;
+
+			if (d > (int32_t)arg * TRIM_MAX / (1000000/T1_HZ) || d < -(int32_t)arg * TRIM_MAX / (1000000/T1_HZ)) {
+				ok = 0;	// way off, arg must be wrong
+			} else {
+				e = d * (1000000/T1_HZ);
+				e = (e + (e < 0 ? -(int32_t)arg : (int32_t)arg) / 2) / (int32_t)arg;	// rounded
+				e += trim;
+				if (e > TRIM_MAX || e < -TRIM_MAX) {
+					ok = 0;
+				} else {
+					settrim(e);
+					flags &= ~_BV(CALSTARTED);
+				}
+			}
 		}
+		break;
+	case 'P':	// clock trim
+		if (!hasarg) {	// show it
+			uart_putstring_P(PSTR("TRIM, "));
+			if (trim < 0)
+				uart_putchar('-');
+			uart_putdec(trim < 0 ? -trim : trim);
+			uart_putchar('\n');
+			ok = 2;
+		} else if (arg > TRIM_MAX) {
+			ok = 0;
+		} else {
+			settrim(neg ? -(int16_t)arg : (int16_t)arg);
+		}
+		break;
+#endif
+	case 'G':	// GM tube type
+		if (!hasarg || arg >= TUBES)
+			ok = 0;
+		else
+			settube(arg);
+		break;
+#if FIXED_COUNT
+	case 'N':	// fixed count mode
+		if (!hasarg || arg > 32767)
+			ok = 0;
+		else
+			setfixed(arg);
+		break;
+#endif
+#if MULTIDROP
+	case 'A':	// bus address
+		if (!hasarg || arg > ADDR_MAX) {
+			ok = 0;
+		} else {
+			address = arg;
+			eeprom_update_byte(&eeaddress, address);
+			interval = address ? 0 : 1;	// a counter on a bus only talks when asked
+		}
+		break;
+#endif
+	default:
+		ok = 0;
+		break;
+	}
 
-		// Send CPM value to the serial port
-		uart_putstring_P(PSTR("CPS, "));
-		utoa(cps, serbuf, 10);		// radix 10
-		uart_putstring(serbuf);
+	if (quiet)
+		ok = 2;
+	if (ok == 1)
+		uart_putstring_P(PSTR("OK\n"));
+	else if (ok == 0)
+		uart_putstring_P(PSTR("ERR\n"));
 
-		uart_putstring_P(PSTR(", CPM, "));
-		ultoa(cpm, serbuf, 10);		// radix 10
-		uart_putstring(serbuf);
+	rxlen = 0;	// ready for the next command
+	rxready = 0;
+}
+#endif
 
-		uart_putstring_P(PSTR(", uSv/hr, "));
+#if COMMANDS || MODBUS
+// Change the length of the fast mode window to n seconds
+// n must divide LONG_PERIOD.  The running sum is recalculated from the sample buffer.
+void setshort(uint8_t n)
+{
+	shortperiod = n;
+	fastscale = LONG_PERIOD / n;
+	fastsum = bufsum(n);
+}
 
-		// calculate uSv/hr based on scaling factor, and multiply result by 100
-		// so we can easily separate the integer and fractional components (2 decimal places)
-		uint32_t usv_scaled = (uint32_t)(cpm*SCALE_FACTOR);	// scale and truncate the integer part
+// Clear all counters and averages, as if we just powered up
+void resetcounts(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < LONG_PERIOD; i++)
+		buffer[i] = 0;
+	slowcpm = 0;
+	fastsum = 0;
+	age = 0;	// start warming up again
+	valid = 0;
+	missed = 0;
+	txoverflow = 0;
+#if CASCADE
+	for (i = 0; i < CASCADE_MIN; i++)
+		minbuf[i] = 0;
+	for (i = 0; i < CASCADE_HOUR; i++)
+		hourbuf[i] = 0;
+	minvalid = 0;
+	hourvalid = 0;
+	minidx = 0;	// so the windows fill up from here
+	houridx = 0;
+	idx = 0;	// so cascade() gets whole minutes
+#endif
+}
+#endif
 
-		// this reports the integer part
-		utoa((uint16_t)(usv_scaled/10000), serbuf, 10);
-		uart_putstring(serbuf);
+#if COMMANDS
+// Send the next part of a sample buffer dump
+// The buffer is bigger than the transmit buffer, so this sends what fits and is called again
+// from the main loop until it's done.  Samples that arrive during the dump are included.
+void senddump(void)
+{
+	if (sending)	// let the report line finish first
+		return;
+	while (dumping && uart_txfree() >= 8) {	// a sample is at most 4 digits, then ", " or CRLF
+		uart_putdec(unpacksample(buffer[dumpidx]));
+		if (++dumpidx >= LONG_PERIOD)
+			dumpidx = 0;
+		if (--dumping)
+			uart_putstring_P(PSTR(", "));
+		else
+			uart_putchar('\n');
+	}
+}
+#endif
 
-		uart_putchar('.');
+#if BINARY_REPORT || COMMANDS
+// log data over the serial port in binary format
+// The report is packed into a struct frame and sent by sendcobs().
+void sendframe(void)
+{
+	struct frame f;
+
+	f.seq = report.seq;
+	f.mode = report.mode;
+	if (report.mode != 3 && valid < LONG_PERIOD)
+		f.mode |= 0x80;
+	f.cpm = report.cpm;
+	f.cps = report.cps;
+	f.usv = usvx100(usv(caltab[tube], report.cpm));
+#if UNC_K
+	f.unc = packsample((report.unc > SAMPLE_MAX) ? SAMPLE_MAX : report.unc);
+#else
+	f.unc = 0;
+#endif
+	sendcobs((uint8_t *)&f, sizeof(f));
+}
 
-		// this reports the fractional part (2 decimal places)
-		uint8_t fraction = (usv_scaled/100)%100;
-		if (fraction < 10)
-			uart_putchar('0');	// zero padding for <0.10
-		utoa(fraction, serbuf, 10);
-		uart_putstring(serbuf);
+#if DOSE
+// Send the total counts and the dose in binary format, in a struct doseframe
+// They change slowly, so they have a frame of their own that is sent once a minute.
+void senddose(void)
+{
+	struct doseframe f;
 
-		// Tell us what averaging method is being used
-		if (mode == 2) {
-			uart_putstring_P(PSTR(", INST"));
-		} else if (mode == 1) {
-			uart_putstring_P(PSTR(", FAST"));
-		} else {
-			uart_putstring_P(PSTR(", SLOW"));
+	f.seq = report.seq;
+	f.kind = DOSE_FRAME;
+	f.total = total;
+	f.dose = dose;
+	sendcobs((uint8_t *)&f, sizeof(f));
+}
+#endif
+
+// Send a binary frame of len bytes, the first 2 of which are set to the CRC of the others
+// The frame is sent COBS encoded: every run of up to 254 non-zero bytes is preceded by its
+// length + 1, which replaces the zero byte that followed it.  A 0x00 byte marks the end.
+void sendcobs(uint8_t *p, uint8_t len)
+{
+	uint16_t crc = 0xFFFF;
+	uint8_t i, j;
+
+	for (i = 2; i < len; i++)
+		crc = _crc16_update(crc, p[i]);
+	p[0] = crc;		// little endian
+	p[1] = crc >> 8;
+
+	// COBS encode, the frames are too short to ever need a 254 byte run
+	for (i = 0; i <= len; i++) {
+		for (j = i; j < len && p[j] != 0; j++)	// find the next zero (or the end)
+			;
+		uart_putbyte(j - i + 1);
+		for (; i < j; i++)
+			uart_putbyte(p[i]);
+	}
+	uart_putbyte(0x00);	// end of frame
+}
+#endif
+
+// Convert CPM to uSv/hr x100,000 with the calibration curve p (in caltab), saturating at 2^32-1
+// Each segment of the curve adds its factor for every CPM up to the start of the next one.
+uint32_t usv(const struct calpoint *p, uint32_t cpm)
+{
+	uint32_t v = 0;		// uSv/hr x100,000 so far
+	uint32_t x = 0;		// CPM so far
+	uint32_t end;		// end of the current segment
+	uint16_t f;
+	uint8_t i;
+
+	for (i = 0; i < CAL_POINTS && x < cpm; i++) {
+		f = pgm_read_word(&p[i].factor);
+		end = (i < CAL_POINTS - 1) ? pgm_read_dword(&p[i+1].cpm) : 0;
+		if (end <= x || end > cpm)	// cpm is in this segment (the last one, or a misplaced one, goes on forever)
+			end = cpm;
+		if (f != 0 && end - x > (UINT32_MAX - v) / f)
+			return UINT32_MAX;
+		v += (end - x) * f;
+		x = end;
+	}
+	return v;
+}
+
+#if UNC_K
+// Uncertainty of the reported uSv/hr x100,000, what the CPM uncertainty amounts to on the curve
+uint32_t usvunc(void)
+{
+	const struct calpoint *p = caltab[tube];
+	uint32_t cpm = report.cpm;
+	uint32_t hi = (cpm > UINT32_MAX - report.unc) ? UINT32_MAX : cpm + report.unc;
+
+	return usv(p, hi) - usv(p, cpm);
+}
+#endif
+
+#if BINARY_REPORT || COMMANDS || MODBUS
+// Convert uSv/hr x100,000 to x100, saturating at 655.35
+uint16_t usvx100(uint32_t v)
+{
+	v /= 1000;
+	return (v > UINT16_MAX) ? UINT16_MAX : v;
+}
+#endif
+
+// Send uSv/hr x100,000 with 2 decimals
+void uart_putusv(uint32_t v)
+{
+	uart_putfixed(v, 5, 2);
+}
+
+#if COMMANDS || MODBUS
+// Change the GM tube type (index of caltab) and save it in EEPROM
+void settube(uint8_t t)
+{
+	tube = t;
+	eeprom_update_byte(&eetube, t);
+}
+#endif
+
+// Send v / 10^frac with dec decimals (truncated, dec <= frac), without leading zeros
+// The AVR has no divider, so instead of dividing by 10 each digit is found by subtracting
+// its power of ten until it doesn't fit anymore: at most 9 subtractions per digit.
+// The decimal point goes frac digits from the right, frac = 0 sends an integer.
+void uart_putfixed(uint32_t v, uint8_t frac, uint8_t dec)
+{
+	uint8_t ones = 9 - frac;	// index of the ones digit
+	uint8_t lead = 1;		// flag, still in the leading zeros
+	uint8_t i;
+	uint32_t p;
+	char d;
+
+	for (i = 0; i <= ones + dec; i++) {
+		if (i == ones + 1)
+			uart_putchar('.');
+		p = pgm_read_dword(&pow10tab[i]);
+		for (d = '0'; v >= p; d++)
+			v -= p;
+		if (d != '0' || i >= ones)	// keep at least the ones digit
+			lead = 0;
+		if (!lead)
+			uart_putchar(d);
+	}
+}
+
+#if MODBUS
+// Answer a Modbus request, once ISR(USART_RX_vect) has received a complete frame
+// Frames with a bad CRC, for another address, or too short are ignored, as Modbus requires.
+void checkmodbus(void)
+{
+	uint8_t f[MB_BUFF_LEN];	// copy of the frame
+	uint8_t len = 0;	// frame length
+	uint16_t crc = 0;	// CRC over the whole frame, 0 if it is good
+	uint8_t fc, err = 0, i;
+	uint16_t reg, n, v;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (mblen && (uint16_t)(timestamp() - mblast) > MB_T35) {	// the line is quiet, the frame is complete
+			len = mblen;
+			crc = mbrxcrc;
+			for (i = 0; i < MB_BUFF_LEN; i++)
+				f[i] = mbbuf[i];
+			mblen = 0;
+		}
+	}
+
+	if (len < 4 || crc != 0 || (f[0] != address && f[0] != 0))
+		return;
+
+	fc = f[1];
+	reg = (f[2] << 8) | f[3];	// register address
+	n = (f[4] << 8) | f[5];		// register count, or value for 06
+	switch (fc) {
+	case 3:	// read holding registers
+	case 4:	// read input registers
+		if (len != 8)
+			return;
+		v = (fc == 4) ? MB_INPUTS : MB_HOLDING;
+		if (n == 0 || n > 125)
+			err = 3;	// illegal data value
+		else if (reg >= v || n > v - reg)
+			err = 2;	// illegal data address
+		break;
+	case 6:	// write single register
+		if (len != 8)
+			return;
+		err = mbwrite(reg < MB_HOLDING ? reg : UINT8_MAX, n);
+		break;
+	default:
+		err = 1;	// illegal function
+		break;
+	}
+
+	if (f[0] == 0)	// broadcasts are never answered
+		return;
+
+	mbcrc = 0xFFFF;
+	mbputbyte(f[0]);
+	if (err) {	// exception response
+		mbputbyte(fc | 0x80);
+		mbputbyte(err);
+	} else if (fc == 6) {	// echo the request
+		for (i = 1; i < 6; i++)
+			mbputbyte(f[i]);
+	} else {
+		mbputbyte(fc);
+		mbputbyte(n * 2);
+		while (n--) {
+			v = mbread(fc, reg++);
+			mbputbyte(v >> 8);
+			mbputbyte(v);
+		}
+	}
+	v = mbcrc;
+	mbputbyte(v);	// CRC, low byte first
+	mbputbyte(v >> 8);
+}
+
+// Return input register (fc = 4) or holding register (fc = 3) reg, see the map at the top
+uint16_t mbread(uint8_t fc, uint8_t reg)
+{
+	if (fc == 4) {
+		switch (reg) {
+		case 0:	return report.cps;
+		case 1:	return report.cpm >> 16;
+		case 2:	return report.cpm;
+		case 3:	return slowcpm >> 16;
+		case 4:	return slowcpm;
+		case 5:	return (fastsum * fastscale) >> 16;
+		case 6:	return fastsum * fastscale;
+		case 7:	return report.mode;
+		case 8:	return usvx100(usv(caltab[tube], report.cpm));
+		case 9:	return report.seq;
+		case 10:	return (report.mode == 3) ? LONG_PERIOD : valid;
+#if UNC_K
+		case 11:	return report.unc >> 16;
+		case 12:	return report.unc;
+		case 13:	return usvx100(usvunc());
+#endif
+#if DOSE
+		case 14:	return total >> 16;
+		case 15:	return total;
+		case 16:	return dose >> 16;
+		case 17:	return dose;
+#endif
 		}
+	} else {
+		switch (reg) {
+		case 0:	return address;
+		case 1:	return zlimit;
+		case 2:	return shortperiod;
+		case 3:	return nobeep;
+#if FIXED_COUNT
+		case 5:	return fctarget;
+#endif
+#if TRIM
+		case 7:	return trim;
+#endif
+		case 8:	return tube;
+		}
+	}
+	return 0;
+}
 
-		// We're done reporting data, output a newline.
-		uart_putchar('\n');
+// Write holding register reg
+// Returns 0, or the Modbus exception code if the register or value is not valid.
+uint8_t mbwrite(uint8_t reg, uint16_t v)
+{
+	switch (reg) {
+	case 0:	// bus address
+		if (v == 0 || v > ADDR_MAX)
+			return 3;
+		address = v;
+		eeprom_update_byte(&eeaddress, address);
+		break;
+	case 1:	// change detection threshold
+		if (v == 0 || v > UINT8_MAX)
+			return 3;
+		zlimit = v;
+		break;
+	case 2:	// fast mode window
+		if (v == 0 || v >= LONG_PERIOD || LONG_PERIOD % v)
+			return 3;
+		setshort(v);
+		break;
+	case 3:	// mute
+		if (v > 1)
+			return 3;
+		nobeep = v;
+		break;
+	case 4:	// reset
+		if (v != 1)
+			return 3;
+		resetcounts();
+		break;
+#if FIXED_COUNT
+	case 5:	// fixed count target
+		if (v > 32767)
+			return 3;
+		setfixed(v);
+		break;
+#endif
+#if DOSE
+	case 6:	// reset the dose
+		if (v != 1)
+			return 3;
+		cleardose();
+		break;
+#endif
+#if TRIM
+	case 7:	// clock trim
+		if ((int16_t)v > TRIM_MAX || (int16_t)v < -TRIM_MAX)
+			return 3;
+		settrim(v);
+		break;
+#endif
+	case 8:	// GM tube type
+		if (v >= TUBES)
+			return 3;
+		settube(v);
+		break;
+	default:
+		return 2;	// illegal data address
 	}
+	return 0;
+}
+
+// Send a byte of a Modbus answer and add it to mbcrc
+// An answer can be longer than txbuf, and must be sent without gaps, so this waits for room.
+void mbputbyte(uint8_t b)
+{
+	mbcrc = _crc16_update(mbcrc, b);
+	while (!uart_txfree())
+		;
+	uart_putbyte(b);
 }
+#endif
 
 // Start of main program
 int main(void)
 {
+	uint8_t tick;	// 1 when a second has passed
+
 	// Configure the UART
 	// Set baud rate generator based on F_CPU
-	UBRRH = (unsigned char)(F_CPU/(16UL*BAUD)-1)>>8;
-	UBRRL = (unsigned char)(F_CPU/(16UL*BAUD)-1);
+	UBRRH = (unsigned char)(BAUD_UBRR(BAUD)>>8);
+	UBRRL = (unsigned char)BAUD_UBRR(BAUD);
+#if BAUD_U2X(BAUD)
+	UCSRA = _BV(U2X);	// double speed mode
+#endif
 
 	// Enable USART transmitter and receiver
 	UCSRB = (1<<RXEN) | (1<<TXEN);
-
-	uart_putstring_P(PSTR("mightyohm.com Geiger Counter " VERSION "\n"));
-	uart_putstring_P(PSTR(URL "\n"));
+#if COMMANDS || MULTIDROP
+	UCSRB |= _BV(TXCIE);	// transmit complete interrupt clears txbusy
+#endif
+#if COMMANDS || MODBUS
+	UCSRB |= _BV(RXCIE);	// receive interrupt, for commands or Modbus
+#endif
 
 	// Set up AVR IO ports
 	DDRB = _BV(PB4) | _BV(PB2);  // set pins connected to LED and piezo as outputs
 	DDRD = _BV(PD6);	// configure PULSE output
+#if MULTIDROP
+	DDRD |= _BV(DE_PIN);	// RS-485 driver enable, low = receive
+#endif
 	PORTD |= _BV(PD3);	// enable internal pull up resistor on pin connected to button
 
+#if !COUNT_HW	// GM pulses are counted by Timer0 instead
 	// Set up external interrupts
 	// INT0 is triggered by a GM impulse
-	// INT1 is triggered by pushing the button
-	MCUCR |= _BV(ISC01) | _BV(ISC11);	// Config interrupts on falling edge of INT0 and INT1
-	GIMSK |= _BV(INT0) | _BV(INT1);		// Enable external interrupts on pins INT0 and INT1
+	// The button is sampled by ISR(TIMER1_COMPA_vect), it doesn't need an interrupt
+	MCUCR |= _BV(ISC01);	// Config interrupt on falling edge of INT0
+	GIMSK |= _BV(INT0);		// Enable external interrupt on pin INT0
+#endif
 
 	// Configure the Timers
-	// Set up Timer0 for tone generation
-	// Toggle OC0A (pin PB2) on compare match and set timer to CTC mode
-	TCCR0A = (0<<COM0A1) | (1<<COM0A0) | (0<<WGM02) |  (1<<WGM01) | (0<<WGM00);
+#if COUNT_HW
+	// Set up Timer0 as an event counter
+	// Normal mode, clocked by the falling edge on T0 (pin PD4)
+	TCCR0A = 0;
+	TCCR0B = _BV(CS02) | _BV(CS01);
+#else
+	// Set up Timer0 for tone generation and flash timing
+	// Set timer to CTC mode, OC0A (pin PB2) is connected in checkevent() if we're beeping
+	TCCR0A = (0<<COM0A1) | (0<<COM0A0) | (0<<WGM02) |  (1<<WGM01) | (0<<WGM00);
 	TCCR0B = 0;	// stop Timer0 (no sound)
+	OCR0A = TONE_TOP;	// toggle OC0A every 161us, period = 322us, freq = 3.1kHz
+#endif
 
-	// Set up Timer1 for 1 second interrupts
+	// Set up Timer1 for TICKS_PER_SEC interrupts a second
 	TCCR1B = _BV(WGM12) | _BV(CS12);  // CTC mode, prescaler = 256 (32us ticks)
-	OCR1A = 31250;	// 32us * 31250 = 1 sec
+	OCR1A = T1_TOP;	// 32us * 250 = 8ms
 	TIMSK = _BV(OCIE1A);  // Timer1 overflow interrupt enable
+#if COUNT_HW
+	TIMSK |= _BV(TOIE0);	// Timer0 overflow interrupt, extends the event counter to 16 bits
+#else
+	TIMSK |= _BV(OCIE0A);	// Timer0 compare interrupt, only fires while Timer0 runs
+#endif
 
 	// Disable beep by default
 	nobeep = 1;
 
+	// Report format and averaging defaults, these can be changed with commands
+#if COMMANDS
+	binary = BINARY_REPORT;
+#endif
+#if COMMANDS || MODBUS
+	interval = 1;
+	zlimit = CHANGE_Z;
+	shortperiod = SHORT_PERIOD;
+	fastscale = LONG_PERIOD/SHORT_PERIOD;
+#endif
+#if DOSE
+	loaddose();	// carry on where we were before the power went off
+#endif
+	tube = eeprom_read_byte(&eetube);
+	if (tube >= TUBES)	// erased EEPROM
+		tube = TUBE;
+#if TRIM
+	trim = ~eeprom_read_word(&eetrim);
+	if (trim > TRIM_MAX || trim < -TRIM_MAX)	// not a valid trim, don't use it
+		trim = 0;
+#endif
+#if FIXED_COUNT
+	fctarget = FC_COUNT;
+#endif
+#if MULTIDROP
+	address = eeprom_read_byte(&eeaddress);
+	if (address > ADDR_MAX)	// erased EEPROM
+		address = 0;
+#if MODBUS
+	if (!address)	// a Modbus slave always needs an address
+		address = 1;
+#endif
+	if (address)	// on a bus, wait to be polled
+		interval = 0;
+#endif
+
 	sei();	// Enable interrupts
 
+#if MULTIDROP
+	if (!address)	// don't talk over the other counters on a bus
+#endif
+	{
+		// the transmit buffer can't hold a whole line, so wait in between
+		uart_putstring_P(PSTR("mightyohm.com Geiger Counter "));
+		uart_flush();
+		uart_putstring_P(PSTR(VERSION "\n"));
+		uart_flush();
+		uart_putstring_P(PSTR(URL "\n"));
+	}
+
 	while(1) {	// loop forever
 
 		// Configure AVR for sleep, this saves a couple mA when idle
@@ -343,7 +2481,27 @@ int main(void)
 
 		checkevent();	// check if we should signal an event (led + beep)
 
-		sendreport();	// send a log report over serial
+		tick = update();	// update the averages if a second has passed
+
+#if FIXED_COUNT
+		fixedcount();	// report a fixed count measurement if one has ended
+#endif
+
+#if COMMANDS
+		checkcommand();	// handle a command from the serial port
+
+		senddump();	// continue a sample buffer dump
+#endif
+
+#if MODBUS
+		checkmodbus();	// answer a Modbus request
+#endif
+
+		sendreport(tick);	// send a log report over serial
+
+#if TIMESTAMPS
+		sendstamps();	// send the event timestamps
+#endif
 
 		checkevent();	// check again before going to sleep
 
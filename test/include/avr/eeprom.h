@@ -0,0 +1,12 @@
+// Host stand-in for <avr/eeprom.h>: the EEPROM is ordinary memory
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM
+
+static inline uint8_t eeprom_read_byte(const uint8_t *p) { return *p; }
+static inline uint16_t eeprom_read_word(const uint16_t *p) { return *p; }
+static inline void eeprom_read_block(void *dst, const void *src, size_t n) { memcpy(dst, src, n); }
+static inline void eeprom_update_byte(uint8_t *p, uint8_t v) { *p = v; }
+static inline void eeprom_update_word(uint16_t *p, uint16_t v) { *p = v; }
+static inline void eeprom_update_block(const void *src, void *dst, size_t n) { memcpy(dst, src, n); }
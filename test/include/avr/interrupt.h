@@ -0,0 +1,4 @@
+// Host stand-in for <avr/interrupt.h>: an ISR is a plain function the test can call
+#define ISR(vector)	void vector(void)
+#define sei()
+#define cli()
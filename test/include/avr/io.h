@@ -0,0 +1,24 @@
+// Host stand-in for <avr/io.h>: the ATtiny registers geiger.c uses, as plain variables
+#include <stdint.h>
+
+volatile uint8_t PORTB, PORTD, PIND, DDRB, DDRD, MCUCR, GIMSK, TIFR, TIMSK;
+volatile uint8_t UCSRA, UCSRB, UBRRH, UBRRL;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, TCCR1B;
+volatile uint8_t GPIOR0, GPIOR1, GPIOR2;
+volatile uint16_t TCNT1, OCR1A, OCR1B;
+
+// What is written to UDR is collected in udrout, so a test can see what was sent
+char udrout[256];
+uint8_t udrlen;
+#define UDR	(*(volatile uint8_t *)&udrout[udrlen++])
+
+#define _BV(b)	(1 << (b))
+#define loop_until_bit_is_set(r, b)	((void)0)	// the stand-in UART is always ready
+
+enum {
+	PB2 = 2, PB4 = 4, PD3 = 3, PD4 = 4, PD5 = 5, PD6 = 6,
+	U2X = 1, UDRE = 5, TXEN = 3, RXEN = 4, UDRIE = 5, TXCIE = 6, RXCIE = 7,
+	WGM00 = 0, WGM01 = 1, WGM02 = 3, CS01 = 1, CS02 = 2, COM0A0 = 6, COM0A1 = 7,
+	WGM12 = 3, CS12 = 2, TOV0 = 1, OCF1B = 5, OCF1A = 6, OCIE0A = 0, TOIE0 = 1, OCIE1B = 5, OCIE1A = 6,
+	ISC01 = 1, INT0 = 6
+};
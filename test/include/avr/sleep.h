@@ -0,0 +1,6 @@
+// Host stand-in for <avr/sleep.h>
+#define SLEEP_MODE_IDLE		0
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_cpu()
+#define sleep_disable()
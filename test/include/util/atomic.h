@@ -0,0 +1,3 @@
+// Host stand-in for <util/atomic.h>: there are no interrupts to hold off
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type)	for (int atomic_once = 1; atomic_once; atomic_once = 0)
@@ -0,0 +1,157 @@
+/*
+	Host test of the calibration curves in caltab
+
+	usv() walks a curve segment by segment and expects the start CPM of the segments to increase.
+	This checks that every curve starts at 0 CPM, that its start CPMs increase up to the first unused
+	entry (0), that nothing follows that, and that every segment has a factor.  It then compares usv()
+	with the curve worked out in 64 bits, for every CPM up to 1,000,000 and around each start CPM.
+	The curves in caltab have a single segment, so the same is done for the multi-segment curves in
+	testtab, where it is also checked that the slope changes to the factor of the next segment right at
+	each start CPM, and that a few values come out as worked out by hand.
+
+	Build and run with "make test".
+*/
+
+#define main geiger_main
+#include "../geiger.c"
+#undef main
+
+#include <stdio.h>
+
+// Curves with more segments than the ones in caltab
+static const struct calpoint testtab[][CAL_POINTS] PROGMEM = {
+	{ { 0, 570 }, { 10000, 620 }, { 100000, 800 }, { 1000000, 1500 } },	// all segments used
+	{ { 0, 210 }, { 60000, 180 } },						// falling slope, unused entries
+	{ { 0, 65535 }, { 1, 1 }, { 2, 65535 }, { 3000000, 2 } },		// 1 CPM segments, saturation
+};
+#define TESTS	(sizeof(testtab) / sizeof(testtab[0]))
+
+// usv() of the first curve in testtab, worked out by hand
+static const struct {
+	uint32_t cpm, usv;
+} handtab[] = {
+	{ 0, 0 },
+	{ 1, 570 },
+	{ 10000, 5700000 },		// end of the first segment
+	{ 10001, 5700620 },
+	{ 100000, 61500000 },		// 5,700,000 + 90,000 x 620
+	{ 100001, 61500800 },
+	{ 1000000, 781500000 },		// 61,500,000 + 900,000 x 800
+	{ 1000001, 781501500 },
+	{ 3000000, 3781500000U },	// 781,500,000 + 2,000,000 x 1500
+	{ 3342311, 4294966500U },	// + 2,342,311 x 1500, the largest that fits
+	{ 3342312, UINT32_MAX },	// saturated
+};
+
+// uSv/hr x100,000 of curve p at cpm, the slow way, saturating like usv()
+static uint32_t refusv(const struct calpoint *p, uint32_t cpm)
+{
+	uint64_t v = 0;
+	uint64_t end;
+	uint8_t i;
+
+	for (i = 0; i < CAL_POINTS && (i == 0 || p[i].cpm); i++) {
+		end = (i < CAL_POINTS - 1 && p[i+1].cpm) ? p[i+1].cpm : UINT64_MAX;
+		if (cpm > p[i].cpm)
+			v += (uint64_t)((cpm < end ? cpm : end) - p[i].cpm) * p[i].factor;
+	}
+	return (v > UINT32_MAX) ? UINT32_MAX : v;
+}
+
+static int check(const char *name, uint8_t c, const struct calpoint *p, uint32_t cpm)
+{
+	if (usv(p, cpm) != refusv(p, cpm)) {
+		printf("%s %u, CPM %lu: usv() %lu, expected %lu\n", name, c, (unsigned long)cpm,
+			(unsigned long)usv(p, cpm), (unsigned long)refusv(p, cpm));
+		return 1;
+	}
+	return 0;
+}
+
+// Check the table entries of curve p, and usv() against refusv(), returns the # of segments (0 on failure)
+static uint8_t checkcurve(const char *name, uint8_t c, const struct calpoint *p)
+{
+	uint32_t cpm;
+	uint8_t i, n;
+	int8_t d;
+
+	if (p[0].cpm != 0) {
+		printf("%s %u: the curve starts at %lu CPM, not 0\n", name, c, (unsigned long)p[0].cpm);
+		return 0;
+	}
+	for (n = 1; n < CAL_POINTS && p[n].cpm; n++) {	// n = # of segments
+		if (p[n].cpm <= p[n-1].cpm) {
+			printf("%s %u: segment %u starts at %lu CPM, after %lu\n", name, c, n,
+				(unsigned long)p[n].cpm, (unsigned long)p[n-1].cpm);
+			return 0;
+		}
+	}
+	for (i = 0; i < CAL_POINTS; i++) {
+		if (i < n && p[i].factor == 0) {
+			printf("%s %u: segment %u has no factor\n", name, c, i);
+			return 0;
+		}
+		if (i >= n && (p[i].cpm || p[i].factor)) {
+			printf("%s %u: entry %u follows the last segment\n", name, c, i);
+			return 0;
+		}
+	}
+
+	for (cpm = 0; cpm <= 1000000; cpm++)
+		if (check(name, c, p, cpm))
+			return 0;
+	for (i = 1; i < n; i++)
+		for (d = -2; d <= 2; d++)
+			if (check(name, c, p, p[i].cpm + d))
+				return 0;
+	for (cpm = 1000000; cpm < UINT32_MAX / 2; cpm *= 2)	// up to and beyond saturation
+		if (check(name, c, p, cpm) || check(name, c, p, cpm + 1))
+			return 0;
+	if (check(name, c, p, UINT32_MAX))
+		return 0;
+	return n;
+}
+
+int main(void)
+{
+	const struct calpoint *p;
+	uint8_t c, i, n;
+	uint32_t b, lo, hi;
+
+	for (c = 0; c < TUBES; c++)
+		if (!checkcurve("tube", c, caltab[c]))
+			return 1;
+
+	for (c = 0; c < TESTS; c++) {
+		p = testtab[c];
+		n = checkcurve("test curve", c, p);
+		if (n < 2) {
+			if (n)
+				printf("test curve %u has a single segment\n", c);
+			return 1;
+		}
+		// Each segment's factor applies from its start CPM on: the CPM before the breakpoint still adds
+		// the factor of the previous segment, the one after it the new factor
+		for (i = 1; i < n; i++) {
+			b = p[i].cpm;
+			lo = usv(p, b) - usv(p, b - 1);
+			hi = usv(p, b + 1) - usv(p, b);
+			if (usv(p, b + 1) < UINT32_MAX && (lo != p[i-1].factor || hi != p[i].factor)) {
+				printf("test curve %u, breakpoint %lu: slope %lu before, %lu after, expected %u and %u\n",
+					c, (unsigned long)b, (unsigned long)lo, (unsigned long)hi, p[i-1].factor, p[i].factor);
+				return 1;
+			}
+		}
+	}
+
+	for (i = 0; i < sizeof(handtab) / sizeof(handtab[0]); i++) {
+		if (usv(testtab[0], handtab[i].cpm) != handtab[i].usv) {
+			printf("test curve 0, CPM %lu: usv() %lu, expected %lu\n", (unsigned long)handtab[i].cpm,
+				(unsigned long)usv(testtab[0], handtab[i].cpm), (unsigned long)handtab[i].usv);
+			return 1;
+		}
+	}
+
+	printf("test_caltab: %u tubes, %u multi-segment test curves OK\n", (unsigned)TUBES, (unsigned)TESTS);
+	return 0;
+}
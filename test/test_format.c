@@ -0,0 +1,153 @@
+/*
+	Host test of the number formatting in uart_putfixed()
+
+	uart_putfixed() and uart_putdec() find the digits by subtracting powers of ten.  This checks that
+	what they send is byte for byte what the old division based code (utoa()/ultoa(), and x/10000 and
+	(x/100)%100 for uSv/hr) sent, for every CPM value a report can have: up to 16 x 60 x 65535, the
+	largest dead time corrected rate.  The uSv/hr value is checked for every tube in caltab, and for
+	the SBM-20 against the old code itself up to where usv() saturates at 42949.67 uSv/hr (the old
+	code's uint16_t cast wrapped a little later, at 11,497,544 CPM).
+
+	Build and run with "make test".
+*/
+
+#define main geiger_main
+#include "../geiger.c"
+#undef main
+
+#include <stdio.h>
+#include <string.h>
+
+#define CPM_MAX		(16UL * 60 * 65535)	// largest CPM in a report
+
+static char out[sizeof(udrout) + 1];	// what was sent
+
+// Start capturing what's sent to the UART
+static void capture(void)
+{
+#if TX_BUFF_LEN
+	txhead = 0;
+	txtail = 0;
+	txoverflow = 0;
+#else
+	udrlen = 0;
+#endif
+}
+
+// Return what was sent since capture()
+static char *sent(void)
+{
+#if TX_BUFF_LEN
+	memcpy(out, (char *)txbuf, txhead);
+	out[txhead] = '\0';
+#else
+	memcpy(out, udrout, udrlen);
+	out[udrlen] = '\0';
+#endif
+	return out;
+}
+
+// ultoa(v, buf, 10), the way the old code did it
+static char *ref_ultoa(uint32_t v, char *buf)
+{
+	char tmp[11];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n)
+		*buf++ = tmp[--n];
+	*buf = '\0';
+	return buf;
+}
+
+// v / 10^frac with dec decimals, by dividing
+static void ref_fixed(uint32_t v, uint32_t pow, uint32_t div, uint8_t dec, char *buf)
+{
+	uint32_t f = v % pow / div;	// the decimals we keep
+
+	buf = ref_ultoa(v / pow, buf);
+	*buf++ = '.';
+	while (dec--) {
+		div = f;
+		for (uint8_t i = 0; i < dec; i++)
+			div /= 10;
+		*buf++ = '0' + div % 10;
+	}
+	*buf = '\0';
+}
+
+// The uSv/hr value of the old sendreport(), x = cpm * SCALE_FACTOR (57, x10,000)
+static void old_usv(uint32_t cpm, char *buf)
+{
+	uint32_t usv_scaled = (uint32_t)(cpm*57);
+	uint8_t fraction;
+
+	buf = ref_ultoa((uint16_t)(usv_scaled/10000), buf);
+	*buf++ = '.';
+	fraction = (usv_scaled/100)%100;
+	if (fraction < 10)
+		*buf++ = '0';
+	ref_ultoa(fraction, buf);
+}
+
+static int fail(const char *what, uint32_t v, const char *expect)
+{
+	printf("%s(%lu): sent \"%s\", expected \"%s\"\n", what, (unsigned long)v, out, expect);
+	return 1;
+}
+
+int main(void)
+{
+	char expect[24];
+	uint32_t cpm, v, step, old = 0;
+	uint8_t t;
+
+	for (cpm = 0; cpm <= CPM_MAX; cpm++) {
+		capture();
+		uart_putdec(cpm);
+		ref_ultoa(cpm, expect);
+		if (strcmp(sent(), expect))
+			return fail("uart_putdec", cpm, expect);
+
+		for (t = 0; t < TUBES; t++) {
+			v = usv(caltab[t], cpm);
+			capture();
+			uart_putusv(v);
+			ref_fixed(v, 100000, 1000, 2, expect);
+			if (strcmp(sent(), expect))
+				return fail("uart_putusv", v, expect);
+			if (t == 0 && v < UINT32_MAX) {
+				old_usv(cpm, expect);
+				if (strcmp(out, expect))
+					return fail("uart_putusv, SBM-20", cpm, expect);
+				old = cpm;
+			}
+		}
+	}
+
+	// The rest of the 32-bit range, in steps of 1 to 9973, and the dose with 3 decimals
+	for (v = 0, step = 1; v < UINT32_MAX - step; v += step, step = step % 9973 + 1) {
+		capture();
+		uart_putdec(v);
+		ref_ultoa(v, expect);
+		if (strcmp(sent(), expect))
+			return fail("uart_putdec", v, expect);
+
+		capture();
+		uart_putfixed(v, 3, 3);	// the dose
+		ref_fixed(v, 1000, 1, 3, expect);
+		if (strcmp(sent(), expect))
+			return fail("uart_putfixed", v, expect);
+	}
+	capture();
+	uart_putdec(UINT32_MAX);
+	if (strcmp(sent(), "4294967295"))
+		return fail("uart_putdec", UINT32_MAX, "4294967295");
+
+	printf("test_format: CPM 0 to %lu, %u tubes OK, same as the old code up to %lu\n",
+		(unsigned long)CPM_MAX, (unsigned)TUBES, (unsigned long)old);
+	return 0;
+}
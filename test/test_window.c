@@ -0,0 +1,116 @@
+/*
+	Host test of the averaging windows in update()
+
+	update() keeps slowcpm and fastsum as running sums: every second the new sample is added and the
+	one that leaves the window is subtracted.  This feeds it a long random sequence of count rates, the
+	way ISR(TIMER1_COMPA_vect) hands them over, and checks after every second that each running sum
+	equals the sum of its window in the sample buffer, and that the change detection window (age) stays
+	within the samples seen since the last reset (valid).  With COMMANDS or MODBUS, it also changes the
+	fast window with setshort() and resets everything with resetcounts() now and then.
+
+	Build and run with "make test".
+*/
+
+#define main geiger_main
+#include "../geiger.c"
+#undef main
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SECONDS		2000000		// seconds to simulate
+
+// Sum of the newest n samples in the sample buffer, the slow way
+static uint32_t windowsum(uint8_t n)
+{
+	uint32_t sum = 0;
+	uint8_t i = idx;
+
+	while (n--) {
+		i = i ? i - 1 : LONG_PERIOD - 1;
+		sum += unpacksample(buffer[i]);
+	}
+	return sum;
+}
+
+// Hand one second's counts to update(), like ISR(TIMER1_COMPA_vect) does
+static void second(uint16_t n)
+{
+	sample = n;
+	tickseq++;
+	update();
+}
+
+// A count rate that changes now and then, from background to beyond SAMPLE_MAX
+static uint16_t nextcount(void)
+{
+	static uint32_t rate = 20;
+
+	switch (rand() % 200) {
+	case 0:
+		rate = rand() % 30;
+		break;
+	case 1:
+		rate = rand() % 1000;
+		break;
+	case 2:
+		rate = rand() % 70000;
+		break;
+	}
+	return (rate > 0 && rand() % 2) ? rate + rand() % (rate / 8 + 2) - rate / 16 : rate;
+}
+
+int main(void)
+{
+#if COMMANDS || MODBUS
+	static const uint8_t shorts[] = { 1, 2, 3, 4, 5, 6, 10, 12, 15, 20, 30 };
+#endif
+	uint32_t s;
+	uint8_t since = 0;	// seconds since the last resetcounts(), up to LONG_PERIOD
+
+	srand(1);
+#if COMMANDS || MODBUS	// what main() sets up, otherwise they are constants
+	shortperiod = SHORT_PERIOD;
+	fastscale = LONG_PERIOD/SHORT_PERIOD;
+	zlimit = CHANGE_Z;
+#endif
+
+	for (s = 0; s < SECONDS; s++) {
+		second(nextcount());
+		if (since < LONG_PERIOD)
+			since++;
+
+		if (slowcpm != windowsum(LONG_PERIOD)) {
+			printf("second %lu: slowcpm %lu, buffer sum %lu\n", (unsigned long)s,
+				(unsigned long)slowcpm, (unsigned long)windowsum(LONG_PERIOD));
+			return 1;
+		}
+		if (fastsum != windowsum(shortperiod)) {
+			printf("second %lu: fastsum %lu, sum of the last %u samples %lu\n", (unsigned long)s,
+				(unsigned long)fastsum, shortperiod, (unsigned long)windowsum(shortperiod));
+			return 1;
+		}
+		if (valid != since || age > valid) {
+			printf("second %lu: valid %u (expected %u), age %u\n", (unsigned long)s, valid, since, age);
+			return 1;
+		}
+
+#if COMMANDS || MODBUS	// the fast window and the reset can only be changed with commands
+		if (rand() % 1000 == 0) {
+			setshort(shorts[rand() % sizeof(shorts)]);
+			if (fastsum != windowsum(shortperiod)) {
+				printf("second %lu: setshort(%u) gives fastsum %lu, expected %lu\n", (unsigned long)s,
+					shortperiod, (unsigned long)fastsum, (unsigned long)windowsum(shortperiod));
+				return 1;
+			}
+		}
+		if (rand() % 5000 == 0) {
+			resetcounts();
+			since = 0;
+		}
+#endif
+	}
+
+	printf("test_window: %lu seconds OK\n", (unsigned long)s);
+	return 0;
+}